@@ -52,11 +52,12 @@ bool flashInit(void);
 bool flashIsReady(void);
 bool flashWaitForReady(void);
 void flashEraseSector(uint32_t address);
+void flashEraseSubsector(uint32_t address);
 void flashEraseCompletely(void);
 void flashPageProgramBegin(uint32_t address);
-void flashPageProgramContinue(const uint8_t *data, int length);
+bool flashPageProgramContinue(const uint8_t *data, int length);
 void flashPageProgramFinish(void);
-void flashPageProgram(uint32_t address, const uint8_t *data, int length);
+bool flashPageProgram(uint32_t address, const uint8_t *data, int length);
 int flashReadBytes(uint32_t address, uint8_t *buffer, int length);
 void flashFlush(void);
 const flashGeometry_t *flashGetGeometry(void);
@@ -63,11 +63,12 @@ typedef struct flashVTable_s {
     bool (*isReady)(flashDevice_t *fdevice);
     bool (*waitForReady)(flashDevice_t *fdevice);
     void (*eraseSector)(flashDevice_t *fdevice, uint32_t address);
+    void (*eraseSubsector)(flashDevice_t *fdevice, uint32_t address);
     void (*eraseCompletely)(flashDevice_t *fdevice);
     void (*pageProgramBegin)(flashDevice_t *fdevice, uint32_t address);
-    void (*pageProgramContinue)(flashDevice_t *fdevice, const uint8_t *data, int length);
+    bool (*pageProgramContinue)(flashDevice_t *fdevice, const uint8_t *data, int length);
     void (*pageProgramFinish)(flashDevice_t *fdevice);
-    void (*pageProgram)(flashDevice_t *fdevice, uint32_t address, const uint8_t *data, int length);
+    bool (*pageProgram)(flashDevice_t *fdevice, uint32_t address, const uint8_t *data, int length);
     void (*flush)(flashDevice_t *fdevice);
     int (*readBytes)(flashDevice_t *fdevice, uint32_t address, uint8_t *buffer, int length);
     const flashGeometry_t *(*getGeometry)(flashDevice_t *fdevice);
@@ -1,6 +1,8 @@
 #ifndef __BLACKBOX_LOGGING_H_
 #define __BLACKBOX_LOGGING_H_
 
+void blackbox_early_capture(void);
+void blackbox_early_capture_stop(void);
 void blackbox_logging_process(void);
 
 #endif // !__BLACKBOX_LOGGING_H_
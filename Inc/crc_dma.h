@@ -0,0 +1,26 @@
+#ifndef _CRC_DMA_H_
+#define _CRC_DMA_H_
+
+#include <stdint.h>
+
+// The CRC unit, fed by DMA2 Stream7 (memory to memory, free on this
+// board) rather than by CPU stores.  The CRC is the one log_record.h
+// describes.  Buffers may be any length and alignment: bytes left over
+// from one buffer make up a word with the next, and the last word is zero
+// padded.  A buffer must stay put until crc_dma_end().
+void crc_dma_init(void);
+
+void crc_dma_begin(void);
+
+// Returns with the DMA still running over buf when it's long enough to
+// be worth one.
+void crc_dma_feed(const void *buf, unsigned int len);
+
+// Waits for the DMA and returns the CRC.
+uint32_t crc_dma_end(void);
+
+// Waits for the DMA to be done with the last buffer fed, so it can be
+// reused before crc_dma_end().
+void crc_dma_wait(void);
+
+#endif // !_CRC_DMA_H_
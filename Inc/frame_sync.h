@@ -0,0 +1,67 @@
+#ifndef _FRAME_SYNC_H_
+#define _FRAME_SYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frame synchroniser for the logging pipeline.  Finds frame boundaries in
+// a byte stream fed in arbitrary pieces, checks each frame, and optionally
+// hands on only the good frames.  Free of HAL dependencies so the same code
+// runs in tools/frame_bench.c.
+
+// Largest frame of any protocol (MAVLink 2, signed, 255 byte payload)
+#define FRAME_SYNC_MAX 280
+
+typedef enum {
+	FRAME_BAD = 0,
+	FRAME_GOOD,
+	FRAME_UNCHECKED,	// boundary known, no way to check contents
+} frame_check_e;
+
+// A protocol.  frame_len() looks at a candidate starting with a sync byte
+// and returns the whole frame's length, 0 if this can't be a frame start,
+// or -1 if it needs more than 'avail' bytes to tell.
+typedef struct frame_proto_s {
+	const char *name;
+	bool (*is_sync)(uint8_t c);
+	int (*frame_len)(const uint8_t *buf, unsigned int avail);
+	frame_check_e (*check)(const uint8_t *frame, unsigned int len);
+	bool can_drop;		// checks are strong enough to drop garbage
+} frame_proto_t;
+
+extern const frame_proto_t frame_proto_mavlink;
+extern const frame_proto_t frame_proto_crsf;
+extern const frame_proto_t frame_proto_blackbox;
+
+typedef struct frame_sync_stats_s {
+	uint32_t good;
+	uint32_t bad;
+	uint32_t unchecked;
+	uint32_t garbage;	// bytes outside any frame
+} frame_sync_stats_t;
+
+// Called with runs of consecutive good frames when dropping garbage
+typedef void (*frame_emit_fn)(void *ctx, const uint8_t *buf,
+		unsigned int len);
+
+typedef struct frame_sync_s {
+	const frame_proto_t *proto;
+	frame_emit_fn emit;	// NULL: count only, caller keeps every byte
+	void *ctx;
+	frame_sync_stats_t stats;
+
+	// A frame cut by the end of a piece is copied here and completed
+	// from the next piece; nothing else is copied.
+	uint8_t carry[FRAME_SYNC_MAX];
+	unsigned int carry_len;
+} frame_sync_t;
+
+const frame_proto_t *frame_sync_find_proto(const char *name,
+		unsigned int name_len);
+
+void frame_sync_init(frame_sync_t *fs, const frame_proto_t *proto,
+		frame_emit_fn emit, void *ctx);
+void frame_sync_feed(frame_sync_t *fs, const uint8_t *buf, unsigned int len);
+void frame_sync_flush(frame_sync_t *fs);
+
+#endif // !_FRAME_SYNC_H_
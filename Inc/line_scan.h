@@ -0,0 +1,45 @@
+#ifndef _LINE_SCAN_H_
+#define _LINE_SCAN_H_
+
+#include <stdint.h>
+
+// Newline search for line framing.  Like rx_ring.h, free of any HAL
+// dependencies so it can be checked on the host.
+
+#define LINE_SCAN_ONES 0x01010101u
+#define LINE_SCAN_HIGHS 0x80808080u
+#define LINE_SCAN_NLS (LINE_SCAN_ONES * '\n')
+
+// Index of the first '\n' in buf, or len if there is none.  Tests a word
+// at a time once buf is word aligned: a byte of w ^ LINE_SCAN_NLS is zero
+// exactly where w holds a newline, and the classic (x - 0x01..) & ~x &
+// 0x80.. test finds a zero byte without looking at each one.
+static inline unsigned int line_scan_nl(const char *buf, unsigned int len)
+{
+	unsigned int i = 0;
+
+	while ((i < len) && ((uintptr_t) (buf + i) & 3)) {
+		if (buf[i] == '\n') {
+			return i;
+		}
+		i++;
+	}
+
+	for (; i + 4 <= len; i += 4) {
+		uint32_t x = *(const uint32_t *) (buf + i) ^ LINE_SCAN_NLS;
+
+		if ((x - LINE_SCAN_ONES) & ~x & LINE_SCAN_HIGHS) {
+			break;
+		}
+	}
+
+	for (; i < len; i++) {
+		if (buf[i] == '\n') {
+			return i;
+		}
+	}
+
+	return len;
+}
+
+#endif // !_LINE_SCAN_H_
@@ -0,0 +1,40 @@
+#ifndef _LOG_RECORD_H_
+#define _LOG_RECORD_H_
+
+#include <stdint.h>
+
+// CRC checked record container ("crcRecords" : true).  The log is a run of
+// records, each a log_record_hdr_t then len bytes of payload: what would
+// otherwise have been written straight to the log (raw bytes, stamped
+// lines, frames, compressed blocks or markers) for one port.  Free of HAL
+// dependencies so tools/logcrc.c shares it.
+//
+// The CRC is the STM32 CRC unit's: CRC-32 polynomial 0x04C11DB7, initial
+// value 0xFFFFFFFF, no reflection and no final XOR, fed 32 bit words.  It
+// covers the header up to the CRC, then the payload, zero padded to a
+// whole number of words, each word taken little endian (as the CPU reads
+// it from memory) and processed most significant bit first.
+#define LOG_RECORD_MAGIC0 'C'
+#define LOG_RECORD_MAGIC1 'R'
+
+typedef enum {
+	LOG_RECORD_LZ = 0x01,		// payload is lz_block.h blocks
+	LOG_RECORD_STAMPED = 0x02,	// lines have "[s.us] " prefixes
+	LOG_RECORD_FRAMES = 0x04,	// good frames only, from frame sync
+} log_record_flags_e;
+
+typedef struct log_record_hdr_s {
+	uint8_t magic[2];
+	uint8_t port;		// USART number, 0 for SPI
+	uint8_t flags;		// log_record_flags_e
+	uint32_t seq;		// per port, counting from 0 at power on
+	uint32_t us;		// timebase_us() as the record was written
+	uint32_t len;		// of the payload; all little endian
+	uint32_t crc;
+} log_record_hdr_t;
+
+// Header bytes covered by the CRC: whole words, so the payload starts a
+// fresh one
+#define LOG_RECORD_CRC_HDR_LEN 16
+
+#endif // !_LOG_RECORD_H_
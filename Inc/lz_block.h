@@ -0,0 +1,51 @@
+#ifndef _LZ_BLOCK_H_
+#define _LZ_BLOCK_H_
+
+#include <stdint.h>
+
+// Block compression for the logging pipeline.  Each block is compressed
+// on its own in the LZ4 block format (no frame, no dictionary carried over
+// from the previous block), so any block can be decoded without the ones
+// before it.  Free of HAL dependencies so the same code runs in
+// tools/unlz.c.
+
+// Blocks are at most this big, so positions fit the 16 bit hash table
+#define LZ_BLOCK_MAX 32768
+
+#define LZ_HASH_LOG 12
+
+// On the wire each block is an lz_block_hdr_t, then comp_len bytes.
+#define LZ_MAGIC0 'L'
+#define LZ_MAGIC1 'Z'
+
+typedef enum {
+	LZ_METHOD_STORED = 0,	// didn't compress; payload is the raw bytes
+	LZ_METHOD_LZ4 = 1,
+} lz_method_e;
+
+typedef struct lz_block_hdr_s {
+	uint8_t magic[2];
+	uint8_t method;
+	uint8_t reserved;
+	uint16_t raw_len;	// little endian, like the rest of the logs
+	uint16_t comp_len;
+} lz_block_hdr_t;
+
+typedef struct lz_state_s {
+	uint16_t table[1 << LZ_HASH_LOG];
+} lz_state_t;
+
+// Room to leave for the output of a block of len bytes
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compress len (<= LZ_BLOCK_MAX) bytes.  Returns the compressed length, or
+// 0 if it won't fit in out_max.
+unsigned int lz_compress(lz_state_t *st, const uint8_t *in, unsigned int len,
+		uint8_t *out, unsigned int out_max);
+
+// Returns the decompressed length, or -1 if the block is corrupt or
+// doesn't fit in out_max.
+int lz_decompress(const uint8_t *in, unsigned int len, uint8_t *out,
+		unsigned int out_max);
+
+#endif // !_LZ_BLOCK_H_
@@ -0,0 +1,39 @@
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Byte pattern matching for capture triggers.  Free of HAL dependencies,
+// like line_scan.h.
+//
+// A pattern is a run of up to PATTERN_MAX positions, each matching one
+// byte:
+//   c       the byte c
+//   .       any byte
+//   [abc]   any of a, b or c; [a-z] a range; [^...] anything but
+//   \n \r \t \0 \xNN   control and arbitrary bytes (also inside [])
+//   \c      c itself, for . [ ] \ ^ -
+// Written in the config as a JSON string, JSON's own \n, \t and \\ escapes
+// come out as the same bytes.
+//
+// Matching is shift-and (bitap): one bit of state per position, so a
+// byte costs a table load, a shift, an OR and an AND, whatever the
+// pattern, and a match can span any number of pieces of the stream.
+#define PATTERN_MAX 32
+
+typedef struct pattern_s {
+	uint32_t mask[256];	// bit i: the byte can be at position i
+	uint32_t match;		// bit of the last position
+} pattern_t;
+
+// Returns false if src isn't a valid pattern (or is empty).
+bool pattern_compile(pattern_t *pat, const char *src, unsigned int len);
+
+// Feed len bytes.  Returns the index of the byte that completed the first
+// match, or -1 if none did; *state carries partial matches from one call
+// to the next (start it at 0).
+int pattern_scan(const pattern_t *pat, uint32_t *state, const uint8_t *buf,
+		unsigned int len);
+
+#endif // !_PATTERN_H_
@@ -0,0 +1,114 @@
+#ifndef _RX_RING_H_
+#define _RX_RING_H_
+
+#include <stdbool.h>
+
+// Position arithmetic for the receive ring.  Kept free of any HAL
+// dependencies so the chunking logic can be exercised on the host with the
+// same byte stream fed either byte-by-byte (ISR) or by NDTR snapshots (DMA).
+
+static inline unsigned int rx_ring_advance(unsigned int cur_pos,
+		unsigned int amt, unsigned int len)
+{
+	cur_pos += amt;
+	if (cur_pos >= len) {
+		cur_pos -= len;
+	}
+
+	return cur_pos;
+}
+
+// Circular DMA counts NDTR down from len to 1 and then reloads len, so the
+// next byte lands at len - NDTR.
+static inline unsigned int rx_ring_dma_wpos(unsigned int len,
+		unsigned int ndtr)
+{
+	if (ndtr >= len) {
+		return 0;
+	}
+
+	return len - ndtr;
+}
+
+// Bytes between the reader and the writer, including any that have wrapped
+// around to the start of the ring.
+static inline unsigned int rx_ring_used(unsigned int rpos, unsigned int wpos,
+		unsigned int len)
+{
+	if (wpos < rpos) {
+		return len - rpos + wpos;
+	}
+
+	return wpos - rpos;
+}
+
+// A circular DMA doesn't wait for the reader: when it advances more than
+// the free room, it writes over the oldest unread bytes.  The ring is then
+// full, its oldest byte the one after the writer (one byte always stays
+// free, or a full ring would look empty).  Moves *rpos there, and *apos
+// too if it was in the way.  Returns how many bytes went that had never
+// been handed out (from the old *apos on); leased bytes before *apos
+// count only in the move.
+static inline unsigned int rx_ring_overrun(unsigned int *rpos,
+		unsigned int *apos, unsigned int advanced, unsigned int free,
+		unsigned int len)
+{
+	unsigned int skip = advanced - free;
+	unsigned int leased = rx_ring_used(*rpos, *apos, len);
+
+	*rpos = rx_ring_advance(*rpos, skip, len);
+
+	if (skip <= leased) {
+		return 0;
+	}
+
+	*apos = *rpos;
+
+	return skip - leased;
+}
+
+// Split a chunk of 'bytes' at 'pos' into the part before the end of the
+// ring and the part that wraps to the start.  Returns the segment count.
+static inline unsigned int rx_ring_split(unsigned int pos, unsigned int bytes,
+		unsigned int len, unsigned int *first, unsigned int *second)
+{
+	if (pos + bytes <= len) {
+		*first = bytes;
+		*second = 0;
+		return 1;
+	}
+
+	*first = len - pos;
+	*second = bytes - *first;
+	return 2;
+}
+
+// Trim a chunk so that it ends on a preferred_align boundary of the ring
+// (when there's at least enough data to reach one), never exceeding
+// max_chunk.
+static inline unsigned int rx_ring_align_chunk(unsigned int bytes,
+		unsigned int rpos, unsigned int preferred_align,
+		unsigned int max_chunk)
+{
+	unsigned int unalign = rpos % preferred_align;
+
+	if (bytes > max_chunk) {
+		bytes = max_chunk;
+	}
+
+	if ((bytes + unalign) >= preferred_align) {
+		// Fixup for align
+		bytes += unalign;
+
+		// Get integral number of align-sized chunks
+		bytes /= preferred_align;
+		bytes *= preferred_align;
+
+		// Unfixup for align
+		bytes -= unalign;
+	}
+
+	return bytes;
+}
+
+#endif // !_RX_RING_H_
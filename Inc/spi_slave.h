@@ -0,0 +1,12 @@
+#ifndef _SPI_SLAVE_H_
+#define _SPI_SLAVE_H_
+
+#include <stdint.h>
+
+// SPI2 receive-only slave capture (PB12 NSS, PB13 SCK, PB15 MOSI).  The
+// data lands in the ring of USART_PORT_SPI and is drained with the usart_rx
+// lease calls like any other port.
+void spi_slave_init(void *rx_buf, uint32_t rx_buf_len, uint8_t mode);
+void spi_slave_nss_IRQHandler(void);
+
+#endif // !_SPI_SLAVE_H_
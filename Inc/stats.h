@@ -0,0 +1,52 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "timebase.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Latency histograms for the storage path, timed with the DWT cycle
+// counter.  Bucket 0 counts times under 2us, bucket i (1 <= i < last)
+// times of 2^i to 2^(i+1) - 1 us, and the last bucket everything longer
+// (2^19 us is 524ms, past the slowest sub-sector erase).  Adding a sample
+// is a subtraction, a divide and a CLZ.
+#define STATS_BUCKETS 20
+
+typedef enum {
+	STATS_WRITE,		// f_write()
+	STATS_SYNC,		// f_sync() / f_datasync()
+	STATS_ERASE,		// sector erase on the write path, to ready
+	STATS_PROGRAM,		// 256 byte page program, including the wait
+				// for the page before
+	STATS_CRC,		// CRC of a record ("crcRecords")
+	STATS_NUM_HIST
+} stats_hist_e;
+
+typedef struct stats_hist_s {
+	uint32_t count;
+	uint32_t max_us;
+	uint32_t bucket[STATS_BUCKETS];
+} stats_hist_t;
+
+extern stats_hist_t stats_hist[STATS_NUM_HIST];
+
+static inline uint32_t stats_start(void)
+{
+	return timebase_cycles();
+}
+
+// Time since stats_start() returned start, in us.  Good for stretches
+// under the cycle counter's wrap (~44s).
+static inline uint32_t stats_elapsed_us(uint32_t start)
+{
+	return (timebase_cycles() - start) / (SystemCoreClock / 1000000);
+}
+
+// Record the time since stats_start() returned start; returns it in us.
+uint32_t stats_end(stats_hist_e which, uint32_t start);
+
+// One line per histogram: name, count, max and the buckets up to the last
+// non-empty one.  Returns the length, as snprintf() would.
+int stats_format_hist(char *buf, size_t len, stats_hist_e which);
+
+#endif // !_STATS_H_
@@ -58,7 +58,17 @@ void PendSV_Handler(void);
 void SysTick_Handler(void);
 void DMA2_Stream0_IRQHandler(void);
 void DMA2_Stream2_IRQHandler(void);
+void DMA2_Stream5_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
+void USART1_IRQHandler(void);
+void USART2_IRQHandler(void);
+void USART6_IRQHandler(void);
+void DMA1_Stream5_IRQHandler(void);
+void DMA2_Stream1_IRQHandler(void);
+void DMA1_Stream3_IRQHandler(void);
+void EXTI15_10_IRQHandler(void);
+void PVD_IRQHandler(void);
+void EXTI0_IRQHandler(void);
 /* USER CODE BEGIN EFP */
 
 /* USER CODE END EFP */
@@ -0,0 +1,23 @@
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include "stm32f4xx_hal.h"
+#include <stdint.h>
+
+// Free running microsecond counter on TIM5 (32 bit, wraps every ~71.6
+// minutes).  Differences are wrap safe as long as they're taken in uint32_t.
+void timebase_init(void);
+
+static inline uint32_t timebase_us(void)
+{
+	return TIM5->CNT;
+}
+
+// Core clock cycles from the DWT cycle counter (wraps every ~44 seconds at
+// 96 MHz), for timing short stretches of code.
+static inline uint32_t timebase_cycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+#endif // !_TIMEBASE_H_
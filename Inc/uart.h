@@ -1,8 +1,110 @@
 #ifndef _UART_H_
 #define _UART_H_
-extern void uart_init(uint32_t baud, void *rx_buf, uint32_t rx_buf_len);
+#include <stdbool.h>
+#include <stdint.h>
 
-const char *usart_receive_chunk(unsigned int timeout,
+// Number of chunks that may be held out of each receive ring at once
+#define USART_RX_MAX_LEASES 4
+
+// Arrival stamps kept per port (one per DMA/IDLE event, or per burst in
+// RXNE mode once usart_rx_enable_stamps() is called).  Older stamps are
+// overwritten.
+#define USART_RX_STAMPS 32
+
+// Receive ports.  USART1 is the primary logging port; USART2 (PA3) and
+// USART6 (PA12, free once USB is shut down) are optional extras.  The SPI2
+// slave (spi_slave.c) is not a USART, but its DMA feeds a ring managed
+// here just the same.
+typedef enum {
+	USART_PORT_1 = 0,
+	USART_PORT_2,
+	USART_PORT_6,
+	USART_PORT_SPI,
+	USART_NUM_PORTS
+} usart_port_e;
+
+typedef struct usart_rx_iov_s {
+	const char *base;
+	unsigned int len;
+} usart_rx_iov_t;
+
+// A zero-copy view of received bytes, still inside the ring.  When the
+// chunk runs past the end of the ring it is described by two segments;
+// len is always the total.  Reception does not reuse the bytes until the
+// lease is released (a DMA overrun excepted: see usart_rx_dma_ISR()).
+typedef struct usart_rx_lease_s {
+	usart_rx_iov_t iov[2];
+	unsigned int iovcnt;
+	unsigned int len;
+	unsigned int slot;
+	usart_port_e port;
+
+	// timebase_us() when the acquire looked at the ring, and how far past
+	// the start of this lease reception had got at that moment: every
+	// byte before lease start + stamp_ahead had arrived by stamp_us.
+	// stamp_ahead is 0 if there is no stamp (the lease ends at a gap).
+	uint32_t stamp_us;
+	unsigned int stamp_ahead;
+
+	// Count of bytes received on the port before this lease's first byte
+	uint32_t rx_index;
+} usart_rx_lease_t;
+
+// Cumulative USART receive line errors
+typedef struct usart_line_errors_s {
+	unsigned int fe;	// framing
+	unsigned int ne;	// noise
+	unsigned int ore;	// overrun
+} usart_line_errors_t;
+
+// RTS flow control statistics
+typedef struct usart_flow_stats_s {
+	unsigned int holdoffs;	// times RTS was deasserted
+	uint32_t held_ms;	// total time RTS was deasserted
+} usart_flow_stats_t;
+
+extern void uart_init(usart_port_e port, uint32_t baud, void *rx_buf,
+		uint32_t rx_buf_len, bool use_dma);
+void uart_stop(usart_port_e port);
+void uart_restart(usart_port_e port, uint32_t baud, void *rx_buf,
+		uint32_t rx_buf_len, bool use_dma);
+unsigned int usart_rx_discard(usart_port_e port);
+void usart_rx_halt(usart_port_e port);
+bool usart_rx_first_us(usart_port_e port, uint32_t *us);
+void usart_rx_enable_stamps(usart_port_e port);
+
+void usart_IRQHandler(usart_port_e port);
+void usart_rx_attach_dma(usart_port_e port, void *rx_buf,
+		uint32_t rx_buf_len);
+void usart_rx_event(usart_port_e port);
+void usart_tick(void);
+
+bool usart_has_rts(usart_port_e port);
+void usart_enable_flow_control(usart_port_e port, unsigned int high_water,
+		unsigned int low_water);
+void usart_get_flow_stats(usart_port_e port, usart_flow_stats_t *stats);
+
+bool usart_rx_ready(usart_port_e port, unsigned int min_preferred_chunk);
+unsigned int usart_rx_used(usart_port_e port);
+bool usart_rx_acquire(usart_port_e port, unsigned int timeout,
+		unsigned int preferred_align,
+		unsigned int min_preferred_chunk,
+		unsigned int max_preferred_chunk,
+		usart_rx_lease_t *lease);
+void usart_rx_commit(usart_rx_lease_t *lease, unsigned int used);
+void usart_rx_release(usart_rx_lease_t *lease);
+
+uint32_t usart_rx_stamp(const usart_rx_lease_t *lease, unsigned int off);
+unsigned int usart_rx_rewind(usart_port_e port, unsigned int bytes,
+		unsigned int guard);
+
+bool usart_rx_take_drop(usart_port_e port, unsigned int *dropped);
+void usart_get_line_errors(usart_port_e port, usart_line_errors_t *errs);
+
+// Single-lease convenience wrapper: each call releases the chunk returned
+// by the previous one.  Never returns a wrapped chunk; the part after the
+// end of the ring comes back from the next call.
+const char *usart_receive_chunk(usart_port_e port, unsigned int timeout,
 		unsigned int preferred_align,
 		unsigned int min_preferred_chunk,
 		unsigned int max_preferred_chunk,
@@ -35,6 +35,11 @@
 /* Exported functions ------------------------------------------------------- */
 extern Diskio_drvTypeDef  USER_Driver;
 
+/* Flash sectors erased since power up, and of those, the ones USER_write()
+   had to erase itself on the write path (not erased ahead by CTRL_TRIM) */
+extern uint32_t USER_erase_count;
+extern uint32_t USER_write_erase_count;
+
 /* USER CODE END 0 */
    
 #ifdef __cplusplus
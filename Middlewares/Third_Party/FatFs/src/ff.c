@@ -3702,6 +3702,9 @@ FRESULT f_write (
 				disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) {
 					ABORT(fs, FR_DISK_ERR);
 			}
+			if (fp->sect != sect && fp->fptr >= fp->obj.objsize) {	/* Growing edge: pad with the erased value */
+				mem_set(fp->buf, 0xFF, SS(fs));
+			}
 #endif
 			fp->sect = sect;
 		}
@@ -3801,6 +3804,37 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize the File Data Only                                        */
+/*-----------------------------------------------------------------------*/
+/* Writes back the file's data buffer like f_sync() but leaves the       */
+/* directory entry and any cached FAT sector alone; the file stays       */
+/* modified, so a later f_sync() or f_close() still updates them.        */
+
+FRESULT f_datasync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) {
+#if !_FS_TINY
+		if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+			if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
+#endif
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* !_FS_READONLY */
 
 
@@ -4485,7 +4519,7 @@ FRESULT f_truncate (
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
 
-	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
+	if (fp->fptr < fp->obj.objsize || (fp->fptr == fp->obj.objsize && fp->obj.sclust)) {	/* Process when fptr is not on the eof, or the chain may run past it (f_expand() mode 2) */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
@@ -5140,7 +5174,7 @@ FRESULT f_setlabel (
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	BYTE opt		/* Operation mode 0:Find and prepare, 1:Find and allocate or 2:Find and allocate, size grows as written */
 )
 {
 	FRESULT res;
@@ -5205,7 +5239,7 @@ FRESULT f_expand (
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
 			fp->obj.sclust = scl;		/* Update object allocation information */
-			fp->obj.objsize = fsz;
+			if (opt == 1) fp->obj.objsize = fsz;	/* Mode 2 leaves the size to follow the data */
 			if (_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
 			fp->flag |= FA_MODIFIED;
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
@@ -53,6 +53,17 @@ void flashEraseSector(uint32_t address)
     flashDevice.vTable->eraseSector(&flashDevice, address);
 }
 
+// Erase the smallest erasable unit (4KB on the W25Q) containing address.
+// Falls back to a full sector erase on devices without one.
+void flashEraseSubsector(uint32_t address)
+{
+    if (flashDevice.vTable->eraseSubsector) {
+        flashDevice.vTable->eraseSubsector(&flashDevice, address);
+    } else {
+        flashDevice.vTable->eraseSector(&flashDevice, address);
+    }
+}
+
 void flashEraseCompletely(void)
 {
     flashDevice.vTable->eraseCompletely(&flashDevice);
@@ -63,9 +74,9 @@ void flashPageProgramBegin(uint32_t address)
     flashDevice.vTable->pageProgramBegin(&flashDevice, address);
 }
 
-void flashPageProgramContinue(const uint8_t *data, int length)
+bool flashPageProgramContinue(const uint8_t *data, int length)
 {
-    flashDevice.vTable->pageProgramContinue(&flashDevice, data, length);
+    return flashDevice.vTable->pageProgramContinue(&flashDevice, data, length);
 }
 
 void flashPageProgramFinish(void)
@@ -73,9 +84,9 @@ void flashPageProgramFinish(void)
     flashDevice.vTable->pageProgramFinish(&flashDevice);
 }
 
-void flashPageProgram(uint32_t address, const uint8_t *data, int length)
+bool flashPageProgram(uint32_t address, const uint8_t *data, int length)
 {
-    flashDevice.vTable->pageProgram(&flashDevice, address, data, length);
+    return flashDevice.vTable->pageProgram(&flashDevice, address, data, length);
 }
 
 int flashReadBytes(uint32_t address, uint8_t *buffer, int length)
@@ -27,6 +27,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "stm32f4xx_hal.h"
 #include "bf_flash_w25q.h"
@@ -42,6 +43,7 @@
 #define W25Q_INSTRUCTION_WRITE_DISABLE                  0x04
 #define W25Q_INSTRUCTION_PAGE_PROGRAM                   0x02
 #define W25Q_INSTRUCTION_SECTOR_ERASE                   0xD8
+#define W25Q_INSTRUCTION_SUBSECTOR_ERASE                0x20
 #define W25Q_INSTRUCTION_BULK_ERASE                     0xC7
 
 #define W25Q_STATUS_FLAG_WRITE_IN_PROGRESS              0x01
@@ -55,6 +57,7 @@
 // The timeout we expect between being able to issue page program instructions
 #define DEFAULT_TIMEOUT_MILLIS       6
 #define SECTOR_ERASE_TIMEOUT_MILLIS  5000
+#define SUBSECTOR_ERASE_TIMEOUT_MILLIS 400
 
 // etracer65 notes: For bulk erase The 25Q16 takes about 3 seconds and the 25Q128 takes about 49
 #define BULK_ERASE_TIMEOUT_MILLIS    50000
@@ -175,6 +178,41 @@ void MX_SPI_DMA_Init(void)
   /*取消选择FLASH: CS高电平 */
 #define W25Q_DISABLE()     (GPIOA->BSRR = GPIO_PIN_4)
 
+/*
+ * Page program data is sent by SPI1 TX DMA (DMA2 Stream2) from one of two
+ * page buffers.  pageProgramContinue() returns as soon as the transfer has
+ * been started; CS is released from DMA2_Stream2_IRQHandler via
+ * HAL_SPI_TxCpltCallback().  The next page is copied into the other buffer
+ * while this one is still on the wire or being programmed, and only then
+ * do we wait for the chip.  If the chip never gets ready (the previous
+ * page's program timed out) or the DMA won't start, the page isn't sent
+ * and pageProgramContinue() returns false.
+ */
+static uint8_t w25q_pageBuf[2][W25Q_PAGESIZE] __attribute__((aligned(4)));
+static uint8_t w25q_pageBufIndex;
+static volatile bool w25q_dmaBusy;
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hspi->Instance == SPI1 && w25q_dmaBusy) {
+        W25Q_DISABLE();
+        w25q_dmaBusy = false;
+    }
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    HAL_SPI_TxCpltCallback(hspi);
+}
+
+// Give up on a page transfer that never completed
+static void w25q_abortDMA(void)
+{
+    HAL_SPI_Abort(&hspi1);
+    W25Q_DISABLE();
+    w25q_dmaBusy = false;
+}
+
 
  /**
   * @brief  向FLASH发送 写使能 命令
@@ -215,6 +253,11 @@ static uint8_t w25q_readStatus()
 
 static bool w25q_isReady(flashDevice_t *fdevice)
 {
+    // The page data is still going out, so the chip can't be ready
+    if (w25q_dmaBusy) {
+        return false;
+    }
+
     // If couldBeBusy is false, don't bother to poll the flash chip for its status
     fdevice->couldBeBusy = fdevice->couldBeBusy && ((w25q_readStatus() & W25Q_STATUS_FLAG_WRITE_IN_PROGRESS) != 0);
 
@@ -232,6 +275,9 @@ static bool w25q_waitForReady(flashDevice_t *fdevice)
     while (!w25q_isReady(fdevice)) {
         uint32_t now = HAL_GetTick();
         if (((int32_t)now - (int32_t)(fdevice->timeoutAt)) >= 0) {
+            if (w25q_dmaBusy) {
+                w25q_abortDMA();
+            }
             return false;
         }
     }
@@ -252,7 +298,7 @@ static uint32_t w25q_readChipId()
 
     if(!HAL_SPI_Receive(&hspi1, rxData, 3, 100))
     {//成功
-        jedecID = rxData[0] << 16 | rxData[1] << 8 | rxData[0];
+        jedecID = rxData[0] << 16 | rxData[1] << 8 | rxData[2];
     }
 
     W25Q_DISABLE();
@@ -306,6 +352,8 @@ static bool w25q_detect(flashDevice_t *fdevice)
 bool w25q_Init(flashDevice_t *fdevice)
 {
     //上电后直接初始化SPI，不需要在此处再次初始化
+    //DMA时钟必须在HAL_SPI_MspInit()初始化DMA流之前打开
+    MX_SPI_DMA_Init();
     MX_SPI1_Init();
 
     //检测是否是W25q类的Flash设备
@@ -335,6 +383,26 @@ static void w25q_eraseSector(flashDevice_t *fdevice, uint32_t address)
     w25q_setTimeout(fdevice, SECTOR_ERASE_TIMEOUT_MILLIS);
 }
 
+static void w25q_eraseSubsector(flashDevice_t *fdevice, uint32_t address)
+{
+    uint8_t txdata[4] = 
+    {
+        W25Q_INSTRUCTION_SUBSECTOR_ERASE, 
+        (uint8_t)((address >> 16) & 0xFF),
+        (uint8_t)((address >>  8) & 0xFF),
+        (uint8_t)((address      ) & 0xFF)
+    };
+
+    w25q_waitForReady(fdevice);
+    w25q_writeEnable(fdevice);
+
+    W25Q_ENABLE();
+    HAL_SPI_Transmit(&hspi1, txdata, 4, 100);
+    W25Q_DISABLE();
+
+    w25q_setTimeout(fdevice, SUBSECTOR_ERASE_TIMEOUT_MILLIS);
+}
+
 static void w25q_eraseCompletely(flashDevice_t *fdevice)
 {
     uint8_t txdata[1] = 
@@ -359,10 +427,9 @@ static void w25q_pageProgramBegin(flashDevice_t *fdevice, uint32_t address)
     fdevice->currentWriteAddress = address;
 }
 
-static void w25q_pageProgramContinue(flashDevice_t *fdevice, const uint8_t *data, int length)
+static bool w25q_pageProgramContinue(flashDevice_t *fdevice, const uint8_t *data, int length)
 {
-    //只是为了强制取消const，让编译器不要报警，因为HAL库的问题
-    uint8_t *constData = (uint8_t *)data;
+    uint8_t *pageBuf = w25q_pageBuf[w25q_pageBufIndex];
 
     uint8_t txdata[4] = 
     {
@@ -372,21 +439,35 @@ static void w25q_pageProgramContinue(flashDevice_t *fdevice, const uint8_t *data
         (uint8_t)((fdevice->currentWriteAddress      ) & 0xFF)
     };
 
-    w25q_waitForReady(fdevice);
+    if (length > W25Q_PAGESIZE) {
+        length = W25Q_PAGESIZE;
+    }
+
+    //上一页可能还在DMA发送或编程中，先准备下一页的数据
+    memcpy(pageBuf, data, length);
+
+    if (!w25q_waitForReady(fdevice)) {
+        return false;
+    }
     w25q_writeEnable(fdevice);
 
-    //write command
+    //write command, CS stays low for the data
     W25Q_ENABLE();
     HAL_SPI_Transmit(&hspi1, txdata, 4, 100);
-    W25Q_DISABLE();
 
-    //write data
-    W25Q_ENABLE();
-    HAL_SPI_Transmit(&hspi1, constData, length, 100);
-    W25Q_DISABLE();
+    //write data, CS is released by the DMA completion
+    w25q_dmaBusy = true;
+    if (HAL_SPI_Transmit_DMA(&hspi1, pageBuf, length) != HAL_OK) {
+        w25q_dmaBusy = false;
+        W25Q_DISABLE();
+        return false;
+    }
+    w25q_pageBufIndex ^= 1;
 
     fdevice->currentWriteAddress += length;
     w25q_setTimeout(fdevice, DEFAULT_TIMEOUT_MILLIS);
+
+    return true;
 }
 
 static void w25q_pageProgramFinish(flashDevice_t *fdevice)
@@ -409,14 +490,19 @@ static void w25q_pageProgramFinish(flashDevice_t *fdevice)
  *
  * If you want to write multiple buffers (whose sum of sizes is still not more than the page size) then you can
  * break this operation up into one beginProgram call, one or more continueProgram calls, and one finishProgram call.
+ *
+ * Returns false if the page couldn't be sent (see pageProgramContinue()).  The program itself finishes after
+ * we return; a timeout there shows as the next call's failure, or waitForReady() returning false.
  */
-static void w25q_pageProgram(flashDevice_t *fdevice, uint32_t address, const uint8_t *data, int length)
+static bool w25q_pageProgram(flashDevice_t *fdevice, uint32_t address, const uint8_t *data, int length)
 {
     w25q_pageProgramBegin(fdevice, address);
 
-    w25q_pageProgramContinue(fdevice, data, length);
+    bool ok = w25q_pageProgramContinue(fdevice, data, length);
 
     w25q_pageProgramFinish(fdevice);
+
+    return ok;
 }
 
 /**
@@ -442,13 +528,11 @@ static int w25q_readBytes(flashDevice_t *fdevice, uint32_t address, uint8_t *buf
 
     w25q_writeEnable(fdevice);
 
-    //write command
+    //write command, CS stays low for the data
     W25Q_ENABLE();
     HAL_SPI_Transmit(&hspi1, txdata, 4, 100);
-    W25Q_DISABLE();
 
     //read data
-    W25Q_ENABLE();
     HAL_SPI_Receive(&hspi1, buffer, length, 100);
     W25Q_DISABLE();
 
@@ -471,6 +555,7 @@ const flashVTable_t w25q_vTable = {
     .isReady = w25q_isReady,
     .waitForReady = w25q_waitForReady,
     .eraseSector = w25q_eraseSector,
+    .eraseSubsector = w25q_eraseSubsector,
     .eraseCompletely = w25q_eraseCompletely,
     .pageProgramBegin = w25q_pageProgramBegin,
     .pageProgramContinue = w25q_pageProgramContinue,
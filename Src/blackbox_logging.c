@@ -2,8 +2,20 @@
 #include "led.h"
 #include "jsmn.h"
 #include "uart.h"
+#include "timebase.h"
+#include "line_scan.h"
+#include "frame_sync.h"
+#include "lz_block.h"
+#include "spi_slave.h"
+#include "diskio.h"
+#include "bf_flash.h"
+#include "stats.h"
+#include "crc_dma.h"
+#include "log_record.h"
+#include "pattern.h"
 #include <string.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <unistd.h>
 
 
@@ -14,8 +26,115 @@
 	 _a < _b ? _a : _b; })
 #endif
 
+#ifndef MAX
+#define MAX(a,b) \
+	({ __typeof__ (a) _a = (a); \
+	 __typeof__ (b) _b = (b); \
+	 _a > _b ? _a : _b; })
+#endif
+
+// Private to ff.c: FIL.buf[] holds bytes not yet written to the disk
+#ifndef FA_DIRTY
+#define FA_DIRTY 0x80
+#endif
+
 #define CFGFILE_NAME "logging.cfg"
-#define LOGNAME_FMT "log000.txt"
+
+// Logs 0-999 are log000.txt..log999.txt in the root directory, as they
+// always were; after that each thousand gets a directory, LOG01/log000.txt
+// being log 1000.  Names are 8.3 (no LFN), and at most this long.
+#define LOGNAME_MAX "LOG99/log999.txt"
+#define LOGS_PER_DIR 1000
+#define LOGS_MAX (100 * LOGS_PER_DIR)
+
+typedef char log_name_t[sizeof(LOGNAME_MAX)];
+
+// Line error counters are written at most this often, and only on change
+#define MARKER_UERR_PERIOD_MS 1000
+
+// CPU idle percentage is written this often
+#define MARKER_IDLE_PERIOD_MS 10000
+
+// Prefer flash sector alignment (4096).  Chunk sizes and the timeout are
+// picked per port by the chunk controller, within the chunkMin/chunkMax
+// and chunkTimeoutMin/chunkTimeoutMax bounds from the config.
+#define CHUNK_ALIGN 4096
+
+// The ingress rate estimate is refreshed this often
+#define RATE_PERIOD_MS 100
+
+// Time index sidecar (logNNN.idx): an idx_header_t, then one idx_entry_t
+// per chunk written.  Offsets count bytes of that port's source stream
+// (dropped bytes included, markers and record headers not).
+#define IDX_MAGIC "LIDX"
+#define IDX_VERSION 1
+
+typedef struct idx_header_s {
+	char magic[4];
+	uint8_t version;
+	uint8_t entry_size;
+	uint16_t reserved;
+} idx_header_t;
+
+typedef struct idx_entry_s {
+	uint8_t port;		// USART number, 0 for SPI
+	uint8_t reserved[3];
+	uint32_t offset;	// every byte before this offset...
+	uint32_t us;		// ...had been received by this timebase_us()
+} idx_entry_t;
+
+// When to f_sync() a log, rewriting its directory entry and FAT sectors.
+// On NOR flash each of those costs a sector erase for a few changed bytes.
+typedef enum {
+	SYNC_IDLE = 0,	// after a chunk timeout with nothing received
+	SYNC_BYTES,	// every syncBytes logged per port
+	SYNC_TIME,	// every syncPeriodMs
+	SYNC_NEVER,	// only when the log is closed
+} sync_policy_e;
+
+static const char *const sync_policy_names[] = {
+	[SYNC_IDLE] = "idle",
+	[SYNC_BYTES] = "bytes",
+	[SYNC_TIME] = "time",
+	[SYNC_NEVER] = "never",
+};
+
+// Compressors for "compress"; blocks are self-describing (see lz_block.h)
+typedef enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_LZ4,
+} compress_e;
+
+static const char *const compress_names[] = {
+	[COMPRESS_NONE] = "none",
+	[COMPRESS_LZ4] = "lz4",
+};
+
+// Trigger capture edges on PA0 (the KEY button on the usual F411 boards),
+// for "triggerEdge"
+typedef enum {
+	TRIGGER_EDGE_NONE = 0,
+	TRIGGER_EDGE_RISING,
+	TRIGGER_EDGE_FALLING,
+	TRIGGER_EDGE_BOTH,
+} trigger_edge_e;
+
+static const char *const trigger_edge_names[] = {
+	[TRIGGER_EDGE_NONE] = "none",
+	[TRIGGER_EDGE_RISING] = "rising",
+	[TRIGGER_EDGE_FALLING] = "falling",
+	[TRIGGER_EDGE_BOTH] = "both",
+};
+
+// Boot-time recovery looks for the end of a log's data in flash pages
+#define FLASH_PAGE_SIZE 256
+
+// Interleaved records have a 16 bit length
+#define RECORD_MAX (15 * 4096)
+
+// Interleaved container record header: CONTAINER_MAGIC, USART number (0 for
+// SPI; 1, 2 or 6), payload length (little endian, 16 bit), then the payload.
+#define CONTAINER_MAGIC 'U'
 
 /**
  * {
@@ -23,7 +142,44 @@
  *      "useSPI":false,
  *      "baudRate":2000000,
  *      "preallocBytes":104857600,
- *      "preallocGrow":false
+ *      "preallocGrow":false,
+ *      "rxDMA":true,
+ *      "inbandMarkers":false,
+ *      "baudRate2":0,
+ *      "baudRate6":0,
+ *      "interleavePorts":false,
+ *      "flowControl":false,
+ *      "flowHighWater":75,
+ *      "flowLowWater":50,
+ *      "chunkMin":4096,
+ *      "chunkMax":40960,
+ *      "chunkTimeoutMin":200,
+ *      "chunkTimeoutMax":1000,
+ *      "ringSafety":50,
+ *      "timeIndex":true,
+ *      "lineStamps":false,
+ *      "frameSync":"none",
+ *      "frameDrop":false,
+ *      "spiMode":0,
+ *      "syncPolicy":"idle",
+ *      "syncBytes":1048576,
+ *      "syncPeriodMs":10000,
+ *      "syncDataOnly":false,
+ *      "recoverLogs":true,
+ *      "compress":"none",
+ *      "compressBlock":4096,
+ *      "rotateBytes":0,
+ *      "rotateSeconds":0,
+ *      "rotateIdleSeconds":0,
+ *      "eraseAheadBytes":65536,
+ *      "statsFile":true,
+ *      "powerFailBudgetUs":2000,
+ *      "crcRecords":false,
+ *      "triggerPattern":"",
+ *      "triggerEdge":"none",
+ *      "preTriggerSeconds":10,
+ *      "postTriggerSeconds":10,
+ *      "triggerSpillBytes":0
  * }
  * 
  */
@@ -37,17 +193,297 @@ const unsigned char lager_cfg[] = {
   0x6c, 0x6c, 0x6f, 0x63, 0x42, 0x79, 0x74, 0x65, 0x73, 0x22, 0x20, 0x3a,
   0x20, 0x31, 0x30, 0x34, 0x38, 0x35, 0x37, 0x36, 0x30, 0x30, 0x2c, 0x0a,
   0x09, 0x22, 0x70, 0x72, 0x65, 0x61, 0x6c, 0x6c, 0x6f, 0x63, 0x47, 0x72,
-  0x6f, 0x77, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x0a,
-  0x7d, 0x0a
+  0x6f, 0x77, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c,
+  0x0a, 0x09, 0x22, 0x72, 0x78, 0x44, 0x4d, 0x41, 0x22, 0x20, 0x3a, 0x20,
+  0x74, 0x72, 0x75, 0x65, 0x2c, 0x0a, 0x09, 0x22, 0x69, 0x6e, 0x62, 0x61,
+  0x6e, 0x64, 0x4d, 0x61, 0x72, 0x6b, 0x65, 0x72, 0x73, 0x22, 0x20, 0x3a,
+  0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x0a, 0x09, 0x22, 0x62, 0x61,
+  0x75, 0x64, 0x52, 0x61, 0x74, 0x65, 0x32, 0x22, 0x20, 0x3a, 0x20, 0x30,
+  0x2c, 0x0a, 0x09, 0x22, 0x62, 0x61, 0x75, 0x64, 0x52, 0x61, 0x74, 0x65,
+  0x36, 0x22, 0x20, 0x3a, 0x20, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x69, 0x6e,
+  0x74, 0x65, 0x72, 0x6c, 0x65, 0x61, 0x76, 0x65, 0x50, 0x6f, 0x72, 0x74,
+  0x73, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x0a,
+  0x09, 0x22, 0x66, 0x6c, 0x6f, 0x77, 0x43, 0x6f, 0x6e, 0x74, 0x72, 0x6f,
+  0x6c, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x0a,
+  0x09, 0x22, 0x66, 0x6c, 0x6f, 0x77, 0x48, 0x69, 0x67, 0x68, 0x57, 0x61,
+  0x74, 0x65, 0x72, 0x22, 0x20, 0x3a, 0x20, 0x37, 0x35, 0x2c, 0x0a, 0x09,
+  0x22, 0x66, 0x6c, 0x6f, 0x77, 0x4c, 0x6f, 0x77, 0x57, 0x61, 0x74, 0x65,
+  0x72, 0x22, 0x20, 0x3a, 0x20, 0x35, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x63,
+  0x68, 0x75, 0x6e, 0x6b, 0x4d, 0x69, 0x6e, 0x22, 0x20, 0x3a, 0x20, 0x34,
+  0x30, 0x39, 0x36, 0x2c, 0x0a, 0x09, 0x22, 0x63, 0x68, 0x75, 0x6e, 0x6b,
+  0x4d, 0x61, 0x78, 0x22, 0x20, 0x3a, 0x20, 0x34, 0x30, 0x39, 0x36, 0x30,
+  0x2c, 0x0a, 0x09, 0x22, 0x63, 0x68, 0x75, 0x6e, 0x6b, 0x54, 0x69, 0x6d,
+  0x65, 0x6f, 0x75, 0x74, 0x4d, 0x69, 0x6e, 0x22, 0x20, 0x3a, 0x20, 0x32,
+  0x30, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x63, 0x68, 0x75, 0x6e, 0x6b, 0x54,
+  0x69, 0x6d, 0x65, 0x6f, 0x75, 0x74, 0x4d, 0x61, 0x78, 0x22, 0x20, 0x3a,
+  0x20, 0x31, 0x30, 0x30, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x72, 0x69, 0x6e,
+  0x67, 0x53, 0x61, 0x66, 0x65, 0x74, 0x79, 0x22, 0x20, 0x3a, 0x20, 0x35,
+  0x30, 0x2c, 0x0a, 0x09, 0x22, 0x74, 0x69, 0x6d, 0x65, 0x49, 0x6e, 0x64,
+  0x65, 0x78, 0x22, 0x20, 0x3a, 0x20, 0x74, 0x72, 0x75, 0x65, 0x2c, 0x0a,
+  0x09, 0x22, 0x6c, 0x69, 0x6e, 0x65, 0x53, 0x74, 0x61, 0x6d, 0x70, 0x73,
+  0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x0a, 0x09,
+  0x22, 0x66, 0x72, 0x61, 0x6d, 0x65, 0x53, 0x79, 0x6e, 0x63, 0x22, 0x20,
+  0x3a, 0x20, 0x22, 0x6e, 0x6f, 0x6e, 0x65, 0x22, 0x2c, 0x0a, 0x09, 0x22,
+  0x66, 0x72, 0x61, 0x6d, 0x65, 0x44, 0x72, 0x6f, 0x70, 0x22, 0x20, 0x3a,
+  0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x0a, 0x09, 0x22, 0x73, 0x70,
+  0x69, 0x4d, 0x6f, 0x64, 0x65, 0x22, 0x20, 0x3a, 0x20, 0x30, 0x2c, 0x0a,
+  0x09, 0x22, 0x73, 0x79, 0x6e, 0x63, 0x50, 0x6f, 0x6c, 0x69, 0x63, 0x79,
+  0x22, 0x20, 0x3a, 0x20, 0x22, 0x69, 0x64, 0x6c, 0x65, 0x22, 0x2c, 0x0a,
+  0x09, 0x22, 0x73, 0x79, 0x6e, 0x63, 0x42, 0x79, 0x74, 0x65, 0x73, 0x22,
+  0x20, 0x3a, 0x20, 0x31, 0x30, 0x34, 0x38, 0x35, 0x37, 0x36, 0x2c, 0x0a,
+  0x09, 0x22, 0x73, 0x79, 0x6e, 0x63, 0x50, 0x65, 0x72, 0x69, 0x6f, 0x64,
+  0x4d, 0x73, 0x22, 0x20, 0x3a, 0x20, 0x31, 0x30, 0x30, 0x30, 0x30, 0x2c,
+  0x0a, 0x09, 0x22, 0x73, 0x79, 0x6e, 0x63, 0x44, 0x61, 0x74, 0x61, 0x4f,
+  0x6e, 0x6c, 0x79, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65,
+  0x2c, 0x0a, 0x09, 0x22, 0x72, 0x65, 0x63, 0x6f, 0x76, 0x65, 0x72, 0x4c,
+  0x6f, 0x67, 0x73, 0x22, 0x20, 0x3a, 0x20, 0x74, 0x72, 0x75, 0x65, 0x2c,
+  0x0a, 0x09, 0x22, 0x63, 0x6f, 0x6d, 0x70, 0x72, 0x65, 0x73, 0x73, 0x22,
+  0x20, 0x3a, 0x20, 0x22, 0x6e, 0x6f, 0x6e, 0x65, 0x22, 0x2c, 0x0a, 0x09,
+  0x22, 0x63, 0x6f, 0x6d, 0x70, 0x72, 0x65, 0x73, 0x73, 0x42, 0x6c, 0x6f,
+  0x63, 0x6b, 0x22, 0x20, 0x3a, 0x20, 0x34, 0x30, 0x39, 0x36, 0x2c, 0x0a,
+  0x09, 0x22, 0x72, 0x6f, 0x74, 0x61, 0x74, 0x65, 0x42, 0x79, 0x74, 0x65,
+  0x73, 0x22, 0x20, 0x3a, 0x20, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x72, 0x6f,
+  0x74, 0x61, 0x74, 0x65, 0x53, 0x65, 0x63, 0x6f, 0x6e, 0x64, 0x73, 0x22,
+  0x20, 0x3a, 0x20, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x72, 0x6f, 0x74, 0x61,
+  0x74, 0x65, 0x49, 0x64, 0x6c, 0x65, 0x53, 0x65, 0x63, 0x6f, 0x6e, 0x64,
+  0x73, 0x22, 0x20, 0x3a, 0x20, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x65, 0x72,
+  0x61, 0x73, 0x65, 0x41, 0x68, 0x65, 0x61, 0x64, 0x42, 0x79, 0x74, 0x65,
+  0x73, 0x22, 0x20, 0x3a, 0x20, 0x36, 0x35, 0x35, 0x33, 0x36, 0x2c, 0x0a,
+  0x09, 0x22, 0x73, 0x74, 0x61, 0x74, 0x73, 0x46, 0x69, 0x6c, 0x65, 0x22,
+  0x20, 0x3a, 0x20, 0x74, 0x72, 0x75, 0x65, 0x2c, 0x0a, 0x09, 0x22, 0x70,
+  0x6f, 0x77, 0x65, 0x72, 0x46, 0x61, 0x69, 0x6c, 0x42, 0x75, 0x64, 0x67,
+  0x65, 0x74, 0x55, 0x73, 0x22, 0x20, 0x3a, 0x20, 0x32, 0x30, 0x30, 0x30,
+  0x2c, 0x0a, 0x09, 0x22, 0x63, 0x72, 0x63, 0x52, 0x65, 0x63, 0x6f, 0x72,
+  0x64, 0x73, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c,
+  0x0a, 0x09, 0x22, 0x74, 0x72, 0x69, 0x67, 0x67, 0x65, 0x72, 0x50, 0x61,
+  0x74, 0x74, 0x65, 0x72, 0x6e, 0x22, 0x20, 0x3a, 0x20, 0x22, 0x22, 0x2c,
+  0x0a, 0x09, 0x22, 0x74, 0x72, 0x69, 0x67, 0x67, 0x65, 0x72, 0x45, 0x64,
+  0x67, 0x65, 0x22, 0x20, 0x3a, 0x20, 0x22, 0x6e, 0x6f, 0x6e, 0x65, 0x22,
+  0x2c, 0x0a, 0x09, 0x22, 0x70, 0x72, 0x65, 0x54, 0x72, 0x69, 0x67, 0x67,
+  0x65, 0x72, 0x53, 0x65, 0x63, 0x6f, 0x6e, 0x64, 0x73, 0x22, 0x20, 0x3a,
+  0x20, 0x31, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x70, 0x6f, 0x73, 0x74, 0x54,
+  0x72, 0x69, 0x67, 0x67, 0x65, 0x72, 0x53, 0x65, 0x63, 0x6f, 0x6e, 0x64,
+  0x73, 0x22, 0x20, 0x3a, 0x20, 0x31, 0x30, 0x2c, 0x0a, 0x09, 0x22, 0x74,
+  0x72, 0x69, 0x67, 0x67, 0x65, 0x72, 0x53, 0x70, 0x69, 0x6c, 0x6c, 0x42,
+  0x79, 0x74, 0x65, 0x73, 0x22, 0x20, 0x3a, 0x20, 0x30, 0x0a, 0x7d, 0x0a
 };
-unsigned int lager_cfg_len = 122;
+unsigned int lager_cfg_len = 984;
 
+static bool cfg_use_spi = false;
+static uint32_t cfg_spi_mode = 0;
 static uint32_t cfg_baudrate = 115200;
+static uint32_t cfg_baudrate2 = 0;
+static uint32_t cfg_baudrate6 = 0;
+static bool cfg_interleave_ports = false;
+static bool cfg_crc_records = false;
 static uint32_t cfg_prealloc = 0;
 static bool cfg_prealloc_grow = false;
+static uint32_t cfg_erase_ahead_bytes = 65536;
+static uint32_t cfg_power_fail_budget_us = 2000;
 static bool cfg_bist = false;
-
-static uint8_t rx_buf[24 * 4096];
+static bool cfg_rx_dma = true;
+static bool cfg_inband_markers = false;
+static bool cfg_flow_control = false;
+static uint32_t cfg_flow_high_water = 75;	// percent of the ring
+static uint32_t cfg_flow_low_water = 50;
+static uint32_t cfg_chunk_min = 1 * 4096;
+static uint32_t cfg_chunk_max = 10 * 4096;
+static uint32_t cfg_chunk_timeout_min = 200;
+static uint32_t cfg_chunk_timeout_max = 1000;
+static uint32_t cfg_ring_safety = 50;		// percent of the ring
+static bool cfg_time_index = true;
+static bool cfg_stats_file = true;
+static bool cfg_line_stamps = false;
+static const frame_proto_t *cfg_frame_sync = NULL;
+static bool cfg_frame_drop = false;
+static sync_policy_e cfg_sync_policy = SYNC_IDLE;
+static uint32_t cfg_sync_bytes = 1024 * 1024;
+static uint32_t cfg_sync_period = 10000;
+static bool cfg_sync_data_only = false;
+static bool cfg_recover_logs = true;
+static compress_e cfg_compress = COMPRESS_NONE;
+static uint32_t cfg_compress_block = 4096;
+static uint32_t cfg_rotate_bytes = 0;
+static uint32_t cfg_rotate_secs = 0;
+static uint32_t cfg_rotate_idle_secs = 0;
+static char cfg_trigger_pattern[4 * PATTERN_MAX + 1];
+static trigger_edge_e cfg_trigger_edge = TRIGGER_EDGE_NONE;
+static uint32_t cfg_pre_trigger_secs = 10;
+static uint32_t cfg_post_trigger_secs = 10;
+static uint32_t cfg_trigger_spill = 0;
+
+static uint8_t rx_buf[24 * 4096] __attribute__((aligned(4)));
+
+// Early capture: from power on, USART1 receives at the default baud rate
+// into all of rx_buf but the scratch recover_log() needs at its front, so
+// a flight controller's first output isn't lost to USB detection,
+// mounting and reading the config.  start_ports() moves what's there into
+// the primary port's ring.
+#define RECOVER_SCRATCH ((sizeof(FIL) + _MAX_SS + CHUNK_ALIGN - 1) / \
+		CHUNK_ALIGN * CHUNK_ALIGN)
+#define EARLY_RING (rx_buf + RECOVER_SCRATCH)
+#define EARLY_RING_LEN (sizeof(rx_buf) - RECOVER_SCRATCH)
+
+// The default config's baudRate
+#define EARLY_BAUD 2000000
+
+static bool early_capture;
+static uint32_t early_baud;
+static unsigned int early_discarded;	// received at the wrong baud rate
+static unsigned int early_bytes;	// handed over to the primary port
+
+typedef struct log_port_s {
+	usart_port_e port;
+	uint8_t number;		// USART number (0: SPI), for names and records
+	uint32_t baud;
+	FIL *fil;
+	uint32_t serviced;	// Tick of the last acquire
+
+	// Offset in the source's byte stream of the next byte we'll log:
+	// bytes logged plus bytes known to have been dropped.
+	uint32_t stream_offset;
+	usart_line_errors_t markers_errs;
+	uint32_t markers_errs_time;
+	usart_flow_stats_t markers_flow;
+	uint32_t markers_flow_time;
+
+	// Chunk controller
+	unsigned int ring_len;
+	unsigned int chunk_min;
+	unsigned int chunk_max;
+	uint32_t chunk_timeout;
+	uint32_t rate;		// ingress, bytes/s
+	uint32_t rate_time;
+	uint32_t rate_total;	// stream_offset + backlog at rate_time
+	uint32_t write_ms;	// recent worst f_write latency, decaying
+
+	// Line framing
+	bool at_line_start;
+	uint32_t line_us_last;	// for unwrapping timebase_us()
+	uint32_t line_us_wraps;
+
+	// Frame sync, when cfg_frame_sync is set
+	frame_sync_t frames;
+	frame_sync_stats_t markers_frames;
+	uint32_t markers_frames_time;
+
+	// Last full sync
+	uint32_t synced_offset;
+	uint32_t synced_time;
+
+	// Log allocated up front as one run: its sectors can be erased ahead
+	// of the data (erase_ahead_idle()), and when recovering, the one
+	// after the data always is (erase_ahead())
+	bool erase_ahead;
+	FSIZE_t erased_to;
+
+	// The log's data is on the flash up to here, as of the last sync; past
+	// it, FatFs only holds back the one sector in its buffer
+	FSIZE_t on_flash;
+
+	// Next CRC record's sequence number
+	uint32_t record_seq;
+
+	// Trigger capture: pattern match state, and bytes taken back into the
+	// ring at the trigger, which were scanned already
+	uint32_t trigger_state;
+	unsigned int scan_skip;
+
+	// Compression: bytes gathered for the next block
+	uint8_t *zbuf;
+	unsigned int zlen;
+
+	// Since power on, for the stats file: bytes received (spilled ones
+	// included), spilled, and covered by a full sync; and the most of the
+	// ring seen in use
+	uint32_t rx_total;
+	uint32_t spilled_total;
+	uint32_t synced_total;
+	unsigned int ring_high;
+} log_port_t;
+
+static log_port_t log_ports[USART_NUM_PORTS];
+static FIL *idx_fil;
+
+// Stats file (logNNN.sts, next to the primary log): the counters and
+// latency histograms since power on, as text.  Rewritten on a full sync,
+// at most every STATS_PERIOD_MS and only if something came in, and as a
+// run's logs close on rotation.  A rewrite costs a sector write or two.
+#define STATS_PERIOD_MS 10000
+#define STATS_LINE_MAX 256
+
+static FIL *stats_fil;
+static uint32_t stats_time;
+static uint32_t stats_rx;
+static uint32_t stats_us;	// spent writing the stats file
+static uint32_t written_total;	// bytes handed to f_write()
+
+// Time spent asleep in the main loop, and the last idle marker
+static uint32_t idle_us;
+static uint32_t idle_marked_us;
+static uint32_t idle_marked_time;
+
+// Syncs done, and what the last sync marker reported
+static uint32_t syncs_full;
+static uint32_t syncs_data;
+static uint32_t sync_marked_full;
+static uint32_t sync_marked_data;
+
+// Sectors erased ahead from the idle loop, and the longest f_write() since
+// the last erase marker
+static uint32_t erases_ahead;
+static uint32_t write_max_us;
+
+// Logs of the previous run fixed up at boot, and the bytes found in them
+// after their recorded ends
+static unsigned int recovered_files;
+static uint32_t recovered_bytes;
+
+// Compression state and output block, shared by the ports, and totals
+// for the compression marker
+static lz_state_t *lz_state;
+static uint8_t *lz_out;
+static unsigned int lz_out_len;
+static uint32_t lz_in_bytes;
+static uint32_t lz_out_bytes;
+static uint64_t lz_cycles;
+static uint32_t lz_marked_in;
+static int log_num_ports;
+static int log_next_port;
+
+// The current run's primary log name and number
+static log_name_t log_name;
+static unsigned int log_index;
+
+// Directory entries read at boot to find the last log, and how long that
+// and opening the new log took
+static unsigned int open_entries;
+static uint32_t open_us;
+
+// Rotation.  The next run's logs are opened and preallocated a file at a
+// time from the idle loop (prepare_next_logs()), into a second set of
+// FILs, so that switching over is only a matter of closing the current
+// ones.  next_fil is indexed like log_ports; ports interleaved into the
+// primary log have none.
+static FIL *next_fil[USART_NUM_PORTS];
+static FIL *next_idx_fil;
+static bool next_erase_ahead[USART_NUM_PORTS];
+static log_name_t next_name;
+static unsigned int next_index;
+static int next_step;
+
+// Files open at once at worst: a log per port (the SPI slave takes
+// USART1's place) and the time index, the next run's set of the same
+// while it's prepared, the stats file as it's rewritten, and the trigger
+// spill, open for the whole run.  FatFs refuses any open past _FS_LOCK.
+#define LOG_PORTS_MAX (USART_NUM_PORTS - 1)
+#define LOG_FILES_MAX ((LOG_PORTS_MAX + 1) * 2 + 2)
+
+_Static_assert(_FS_LOCK >= LOG_FILES_MAX, "_FS_LOCK below the open logs");
+
+static uint32_t run_bytes;	// logged by all ports into this run
+static uint32_t run_start;
+static uint32_t last_rx;	// tick of the last chunk with data
 
 #define NELEMENTS(x) (sizeof(x) / sizeof(*(x)))
 
@@ -95,6 +531,24 @@ static bool parse_bool(const char *cfg_buf, jsmntok_t *t) {
 	return false;	// Unreachable
 }
 
+// Index of the string value in names
+static unsigned int parse_choice(const char *cfg_buf, jsmntok_t *t,
+		const char *const *names, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		const char *name = names[i];
+
+		if (((t->end - t->start) == strlen(name)) &&
+				!strncasecmp(name, cfg_buf + t->start,
+					t->end - t->start)) {
+			return i;
+		}
+	}
+
+	led_panic("?");
+
+	return 0;	// Unreachable
+}
+
 static inline bool compare_key(const char *cfg_buf, jsmntok_t *t,
 		const char *value, jsmntype_t typ) {
 	if ((t->end - t->start) != strlen(value)) {
@@ -171,13 +625,14 @@ void process_config() {
 		led_panic("RCFG");
 	}
 
-	jsmntok_t tokens[100];
+	jsmntok_t tokens[128];
 	jsmn_parser parser;
 
 	jsmn_init(&parser);
 
 	/* parse config */
-	int num_tokens = jsmn_parse(&parser, cfg_buf, amount, tokens, 100);
+	int num_tokens = jsmn_parse(&parser, cfg_buf, amount, tokens,
+			NELEMENTS(tokens));
 
 	// Minimal should be JSMN_OBJECT 
 	if (num_tokens < 1) {
@@ -221,18 +676,109 @@ void process_config() {
 			memcpy(cfg_morse, cfg_buf + next->start, len);
 			cfg_morse[len] = 0;
 		} else if (compare_key(cfg_buf, t, "useSPI", JSMN_PRIMITIVE)) {
-			if (parse_bool(cfg_buf, next)) {
-				// XXX SPI not supported yet
-				led_panic("?SPI?");
-			}
+			cfg_use_spi = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "spiMode", JSMN_PRIMITIVE)) {
+			cfg_spi_mode = parse_num(cfg_buf, next);
 		} else if (compare_key(cfg_buf, t, "baudRate", JSMN_PRIMITIVE)) {
 			cfg_baudrate = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "baudRate2", JSMN_PRIMITIVE)) {
+			cfg_baudrate2 = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "baudRate6", JSMN_PRIMITIVE)) {
+			cfg_baudrate6 = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "interleavePorts", JSMN_PRIMITIVE)) {
+			cfg_interleave_ports = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "crcRecords", JSMN_PRIMITIVE)) {
+			cfg_crc_records = parse_bool(cfg_buf, next);
 		} else if (compare_key(cfg_buf, t, "preallocBytes", JSMN_PRIMITIVE)) {
 			cfg_prealloc = parse_num(cfg_buf, next);
 		} else if (compare_key(cfg_buf, t, "preallocGrow", JSMN_PRIMITIVE)) {
 			cfg_prealloc_grow = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "eraseAheadBytes", JSMN_PRIMITIVE)) {
+			cfg_erase_ahead_bytes = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "powerFailBudgetUs", JSMN_PRIMITIVE)) {
+			cfg_power_fail_budget_us = parse_num(cfg_buf, next);
 		} else if (compare_key(cfg_buf, t, "builtInSelfTest", JSMN_PRIMITIVE)) {
 			cfg_bist = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "rxDMA", JSMN_PRIMITIVE)) {
+			cfg_rx_dma = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "inbandMarkers", JSMN_PRIMITIVE)) {
+			cfg_inband_markers = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "flowControl", JSMN_PRIMITIVE)) {
+			cfg_flow_control = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "flowHighWater", JSMN_PRIMITIVE)) {
+			cfg_flow_high_water = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "flowLowWater", JSMN_PRIMITIVE)) {
+			cfg_flow_low_water = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "chunkMin", JSMN_PRIMITIVE)) {
+			cfg_chunk_min = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "chunkMax", JSMN_PRIMITIVE)) {
+			cfg_chunk_max = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "chunkTimeoutMin", JSMN_PRIMITIVE)) {
+			cfg_chunk_timeout_min = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "chunkTimeoutMax", JSMN_PRIMITIVE)) {
+			cfg_chunk_timeout_max = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "ringSafety", JSMN_PRIMITIVE)) {
+			cfg_ring_safety = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "timeIndex", JSMN_PRIMITIVE)) {
+			cfg_time_index = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "statsFile", JSMN_PRIMITIVE)) {
+			cfg_stats_file = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "lineStamps", JSMN_PRIMITIVE)) {
+			cfg_line_stamps = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "frameSync", JSMN_STRING)) {
+			const char *name = cfg_buf + next->start;
+			int len = next->end - next->start;
+
+			cfg_frame_sync = frame_sync_find_proto(name, len);
+
+			if ((!cfg_frame_sync) && strncmp(name, "none", len)) {
+				led_panic("?");
+			}
+		} else if (compare_key(cfg_buf, t, "frameDrop", JSMN_PRIMITIVE)) {
+			cfg_frame_drop = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "syncPolicy", JSMN_STRING)) {
+			cfg_sync_policy = parse_choice(cfg_buf, next,
+					sync_policy_names,
+					NELEMENTS(sync_policy_names));
+		} else if (compare_key(cfg_buf, t, "syncBytes", JSMN_PRIMITIVE)) {
+			cfg_sync_bytes = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "syncPeriodMs", JSMN_PRIMITIVE)) {
+			cfg_sync_period = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "syncDataOnly", JSMN_PRIMITIVE)) {
+			cfg_sync_data_only = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "recoverLogs", JSMN_PRIMITIVE)) {
+			cfg_recover_logs = parse_bool(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "compress", JSMN_STRING)) {
+			cfg_compress = parse_choice(cfg_buf, next,
+					compress_names,
+					NELEMENTS(compress_names));
+		} else if (compare_key(cfg_buf, t, "compressBlock", JSMN_PRIMITIVE)) {
+			cfg_compress_block = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "rotateBytes", JSMN_PRIMITIVE)) {
+			cfg_rotate_bytes = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "rotateSeconds", JSMN_PRIMITIVE)) {
+			cfg_rotate_secs = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "rotateIdleSeconds", JSMN_PRIMITIVE)) {
+			cfg_rotate_idle_secs = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "triggerPattern", JSMN_STRING)) {
+			int len = next->end - next->start;
+
+			if (len >= sizeof(cfg_trigger_pattern)) {
+				led_panic("?");
+			}
+
+			memcpy(cfg_trigger_pattern, cfg_buf + next->start, len);
+			cfg_trigger_pattern[len] = 0;
+		} else if (compare_key(cfg_buf, t, "triggerEdge", JSMN_STRING)) {
+			cfg_trigger_edge = parse_choice(cfg_buf, next,
+					trigger_edge_names,
+					NELEMENTS(trigger_edge_names));
+		} else if (compare_key(cfg_buf, t, "preTriggerSeconds", JSMN_PRIMITIVE)) {
+			cfg_pre_trigger_secs = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "postTriggerSeconds", JSMN_PRIMITIVE)) {
+			cfg_post_trigger_secs = parse_num(cfg_buf, next);
+		} else if (compare_key(cfg_buf, t, "triggerSpillBytes", JSMN_PRIMITIVE)) {
+			cfg_trigger_spill = parse_num(cfg_buf, next);
 		}
 
 		i++;	// Skip the value too on next iter.
@@ -245,135 +791,2511 @@ void process_config() {
 	}
 }
 
-static int advance_filename(char *f) {
-	while (*f && (!is_digit(*f))) {
-		f++;
+static void format_log_name(char *filename, unsigned int index) {
+	if (index < LOGS_PER_DIR) {
+		sprintf(filename, "log%03u.txt", index);
+	} else {
+		sprintf(filename, "LOG%02u/log%03u.txt", index / LOGS_PER_DIR,
+				index % LOGS_PER_DIR);
+	}
+}
+
+// The number in a directory entry name made of prefix, that many decimal
+// digits, then suffix, or -1.  Case blind: without LFN, FatFs hands back the
+// upper case short names.
+static int parse_log_entry(const char *name, const char *prefix,
+		int digits, const char *suffix) {
+	int prefix_len = strlen(prefix);
+	int value = 0;
+
+	if ((strlen(name) != (size_t) (prefix_len + digits + strlen(suffix))) ||
+			strncasecmp(name, prefix, prefix_len) ||
+			strcasecmp(name + prefix_len + digits, suffix)) {
+		return -1;
 	}
 
-	if (!*f) return -1;	// No digits in string
+	for (int i = prefix_len; i < prefix_len + digits; i++) {
+		if (!is_digit(name[i])) {
+			return -1;
+		}
 
-	while (is_digit(*f)) {
-		f++;
+		value = value * 10 + name[i] - '0';
 	}
 
-	f--;			// Scan backwards
+	return value;
+}
 
-	// Now we're at the last digit.  Increment the number, with ripple
-	// carry.
+// Highest log number in path, which holds the logs from base on, or -1.
+// If last_dir isn't NULL, it gets the highest LOGnn directory number
+// there, or 0.
+static int scan_log_dir(const char *path, int base, int *last_dir) {
+	DIR dir;
+	FILINFO fno;
+	int last = -1;
 
-	while (true) {
-		// If we're not pointing to a digit currently, we lose
-		if (!is_digit(*f)) {
-			return -1;
+	if (f_opendir(&dir, path) != FR_OK) {
+		return -1;
+	}
+
+	while ((f_readdir(&dir, &fno) == FR_OK) && fno.fname[0]) {
+		int n;
+
+		open_entries++;
+
+		if (fno.fattrib & AM_DIR) {
+			n = parse_log_entry(fno.fname, "LOG", 2, "");
+
+			if (last_dir && (n > *last_dir)) {
+				*last_dir = n;
+			}
+		} else {
+			n = parse_log_entry(fno.fname, "log", 3, ".txt");
+
+			if ((n >= 0) && (base + n > last)) {
+				last = base + n;
+			}
 		}
+	}
+
+	f_closedir(&dir);
+
+	return last;
+}
 
-		(*f)++;
+// Highest log number on the disk, or -1 if there are none.  Reads the root
+// directory, and the highest LOGnn directory, once each, rather than
+// probing names one f_open (itself a directory search) at a time.
+static int find_last_log(void) {
+	int last_dir = 0;
+	int last = scan_log_dir("/", 0, &last_dir);
 
-		if (is_digit(*f)) {
-			// We incremented and don't need to carry.  we win.
-			return 0;
+	if (last_dir) {
+		char path[sizeof("LOG99")];
+
+		sprintf(path, "LOG%02u", last_dir);
+
+		// An empty directory still means the thousand before it are
+		// used
+		last = scan_log_dir(path, last_dir * LOGS_PER_DIR, NULL);
+
+		if (last < 0) {
+			last = last_dir * LOGS_PER_DIR - 1;
 		}
+	}
+
+	return last;
+}
+
+static bool recovering(void) {
+	return cfg_recover_logs && (cfg_prealloc > 0);
+}
+
+// Trigger capture: rather than everything, log only from preTriggerSeconds
+// before each trigger (a match of triggerPattern on any port, or an edge
+// on the trigger pin) to postTriggerSeconds after the last one, each
+// capture a log of its own.  See scan_port().
+static bool trigger_mode(void) {
+	return cfg_trigger_pattern[0] || (cfg_trigger_edge != TRIGGER_EDGE_NONE);
+}
+
+// Start of the first whole sector past a log's data
+static FSIZE_t next_sector(FIL *fil) {
+	FSIZE_t next = f_tell(fil) + _MAX_SS - 1;
+
+	return next - next % _MAX_SS;
+}
+
+// Sector number on the disk of offset off of a log allocated up front as
+// one run
+static DWORD log_lba(FIL *fil, FSIZE_t off) {
+	FATFS *fs = fil->obj.fs;
+
+	return fs->database + (fil->obj.sclust - 2) * fs->csize +
+		off / _MAX_SS;
+}
 
-		*f = '0';
+// Erase the sector at offset off of a file allocated as one run, unless
+// it's already erased
+static void erase_run_sector(FIL *fil, FSIZE_t off) {
+	DWORD sect = log_lba(fil, off);
+	DWORD range[2] = { sect, sect };
 
-		f--;
+	disk_ioctl(fil->obj.fs->drv, CTRL_TRIM, range);
+}
+
+// Erase the sector at offset off of a log allocated up front as one run,
+// unless it's past the run or already erased.
+static void erase_log_sector(FIL *fil, FSIZE_t off) {
+	if (off >= cfg_prealloc) {
+		return;
 	}
 
+	erase_run_sector(fil, off);
 }
 
-static void open_log(FIL *fil) {
-	char filename[] = LOGNAME_FMT;
-	FRESULT res;
+// Erase the first sector past the data.  See erase_ahead().
+static void erase_after_data(FIL *fil) {
+	erase_log_sector(fil, next_sector(fil));
+}
+
+// Returns true if the log's space was allocated up front as one run
+static bool prealloc_log(FIL *fil) {
+	if (recovering()) {
+		// Allocate the whole run now, but let the size follow the
+		// data, and get the allocation onto the flash straight away:
+		// at the next boot the data past the last sync is then found
+		// in the file's own clusters (see recover_log()).
+		// The run holds whatever was there before, so erase its
+		// start too, or a log that never gets written (an unused
+		// next log when rotating) would "recover" that.
+		if ((f_expand(fil, cfg_prealloc, 2) == FR_OK) &&
+				(f_sync(fil) == FR_OK)) {
+			erase_after_data(fil);
+			return true;
+		}
+	} else if (cfg_prealloc > 0) {
+		// Attempt to preallocate contig space for the logfile
+		// Best effort only-- figure it's better to keep going if
+		// we can't alloc it at all.
+
+		if ((f_expand(fil, cfg_prealloc, cfg_prealloc_grow ? 1 : 0) ==
+					FR_OK) && cfg_prealloc_grow) {
+			return true;
+		}
+	}
+
+	return false;
+}
 
-	res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
+// Open log *index, or the first free one after it, making its directory
+// if need be; *index and filename get what was opened.  The caller
+// preallocates, once it's done with the previous logs.
+static void open_log_at(FIL *fil, char *filename, unsigned int *index) {
+	FRESULT res;
 
-	while (res == FR_EXIST) {
-		if (advance_filename(filename)) {
+	while (true) {
+		if (*index >= LOGS_MAX) {
 			// ..-. .. .-.. . ...
 			led_panic("FILES");
 		}
 
-		// This is likely n^2 or worse with number of config files
+		format_log_name(filename, *index);
+
+		if (*index >= LOGS_PER_DIR) {
+			char *slash = strchr(filename, '/');
+
+			*slash = 0;
+			res = f_mkdir(filename);
+			*slash = '/';
+
+			if ((res != FR_OK) && (res != FR_EXIST)) {
+				// --- .-... --- --.
+				led_panic("OLOG");
+			}
+		}
+
 		res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
+
+		if (res != FR_EXIST) {
+			break;
+		}
+
+		(*index)++;
 	}
 
 	if (res != FR_OK) {
 		// --- .-... --- --.
 		led_panic("OLOG");
 	}
+}
+
+// Open the log after the last one on the disk.  previous gets the names
+// of the last two logs before it, latest first, or empty strings.
+static void open_log(FIL *fil, char *filename, log_name_t previous[2]) {
+	uint32_t start = timebase_us();
+	int last = find_last_log();
+
+	previous[0][0] = 0;
+	previous[1][0] = 0;
+
+	if (last >= 0) {
+		format_log_name(previous[0], last);
+	}
 
-	if (cfg_prealloc > 0) {
-		// Attempt to preallocate contig space for the logfile
-		// Best effort only-- figure it's better to keep going if
-		// we can't alloc it at all.
+	if (last >= 1) {
+		format_log_name(previous[1], last - 1);
+	}
 
-		f_expand(fil, cfg_prealloc, cfg_prealloc_grow ? 1 : 0);
+	log_index = last + 1;
+	open_log_at(fil, filename, &log_index);
+
+	open_us = timebase_us() - start;
+}
+
+// Extra ports logging to separate files get the primary log's name with
+// their USART number appended, e.g. log007.txt -> log007_2.txt
+// filename must have room for LOGNAME_MAX plus two.
+static void port_log_name(char *filename, const char *primary,
+		uint8_t number) {
+	const char *ext = strchr(primary, '.');
+	int base_len = ext - primary;
+
+	memcpy(filename, primary, base_len);
+	filename[base_len] = '_';
+	filename[base_len + 1] = '0' + number;
+	strcpy(filename + base_len + 2, ext);
+}
+
+static bool open_port_log(FIL *fil, const char *primary, uint8_t number) {
+	char filename[sizeof(LOGNAME_MAX) + 2];
+
+	port_log_name(filename, primary, number);
+
+	if (f_open(fil, filename, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
 	}
 
+	return prealloc_log(fil);
 }
 
+// Length of the data at the start of a sector read back from the flash:
+// up to the first erased (all 0xFF) page, less the 0xFF padding FatFs
+// leaves after the data in a partly written sector.  _MAX_SS if no page
+// is erased.
+static unsigned int sector_data_len(const uint8_t *sec) {
+	for (unsigned int page = 0; page < _MAX_SS; page += FLASH_PAGE_SIZE) {
+		unsigned int i = 0;
 
-void blackbox_logging_process(void)
-{
-    
-    retUSER = f_mount(&USERFatFS, USERPath, 1);
-    if (retUSER != FR_OK)
-    {
-        led_panic("DATA ");
-    }
-    
-    process_config();
-    uart_init(cfg_baudrate, rx_buf, sizeof(rx_buf));
+		while ((i < FLASH_PAGE_SIZE) && (sec[page + i] == 0xFF)) {
+			i++;
+		}
 
-    FIL log_file;
-    open_log(&log_file);
+		if (i == FLASH_PAGE_SIZE) {
+			while (page && (sec[page - 1] == 0xFF)) {
+				page--;
+			}
 
-    while(1)
-    {
-        const char *pos;
-		unsigned int amt;
+			return page;
+		}
+	}
 
-		// 50 ticks == 200ms, prefer 512 byte sector alignment,
-		// and >= 2560 byte chunks are best
-		// Never get more than about 2/5 of the buffer (40 * 1024)--
-		// because we want to finish the IO and free it up
-        // 上面是OpenLager的原本设置
-        // 本案例的tick = 1ms，flash的sector size = 4096
-		pos = usart_receive_chunk(200, 4096, 1*4096,
-				10*4096, &amt);
+	return _MAX_SS;
+}
 
-		// Could consider if pos is short, waiting a little longer
-		// (400-600ms?) next time...
+// With crcRecords, each record is its own commit marker: the data ends
+// after the last record whose CRC checks, whatever bytes it holds, so
+// binary streams with runs of 0xFF recover whole.  Walks the records of
+// the run starting at sector base from off, a record boundary (syncs
+// only come between records), up to limit, a sector at a time through
+// sec.  Returns the end of the last good record.
+static FSIZE_t recover_records(FATFS *fs, DWORD base, FSIZE_t off,
+		FSIZE_t limit, uint8_t *sec) {
+	FSIZE_t end = off;
+	FSIZE_t pos = off;
+	FSIZE_t loaded = limit;		// offset of the sector in sec
+	log_record_hdr_t hdr;
+	unsigned int have = 0;		// header bytes gathered
+	uint32_t left = 0;		// payload bytes still to check
+
+	crc_dma_init();
+
+	while (pos < limit) {
+		FSIZE_t at_sector = pos - pos % _MAX_SS;
+		unsigned int at = pos % _MAX_SS;
+		unsigned int n = _MAX_SS - at;
+
+		if (at_sector != loaded) {
+			// The CRC DMA may still be reading the last one
+			crc_dma_wait();
+
+			if (disk_read(fs->drv, sec, base + at_sector / _MAX_SS,
+						1) != RES_OK) {
+				break;
+			}
 
-		led_set(true);	// Illuminate LED during IO
+			loaded = at_sector;
+		}
 
-		FRESULT res;
+		if (have < sizeof(hdr)) {
+			n = MIN(n, sizeof(hdr) - have);
+			memcpy((uint8_t *) &hdr + have, sec + at, n);
+			have += n;
+			pos += n;
 
-		if (!amt) {
-			// If nothing has happened in 200ms, flush our
-			// buffers.
-			res = f_sync(&log_file);
+			if (have < sizeof(hdr)) {
+				continue;
+			}
 
-			if (res != FR_OK) {
-				// . .-. .-.
-				led_panic("SERR");
+			// Erased flash, or what's left of a cut off write
+			if ((hdr.magic[0] != LOG_RECORD_MAGIC0) ||
+					(hdr.magic[1] != LOG_RECORD_MAGIC1) ||
+					(hdr.len > limit - pos)) {
+				break;
 			}
+
+			crc_dma_begin();
+			crc_dma_feed(&hdr, LOG_RECORD_CRC_HDR_LEN);
+			left = hdr.len;
 		} else {
-			UINT written;
+			n = MIN(n, left);
+			crc_dma_feed(sec + at, n);
+			left -= n;
+			pos += n;
+		}
+
+		if (!left) {
+			if (crc_dma_end() != hdr.crc) {
+				break;
+			}
+
+			end = pos;
+			have = 0;
+		}
+	}
+
+	crc_dma_wait();
+
+	return end;
+}
+
+// A log allocated up front for recovery is one run of clusters, and the
+// sector after its data is kept erased (erase_ahead()).  So after a power
+// cut, whatever was written past the last sync is found by reading on
+// from the recorded size to the first erased page, or with crcRecords to
+// the last good record (recover_records()); the size in the directory is
+// then moved there, and the rest of the run given back.  Without records,
+// data that really ended in 0xFF bytes loses them, and a page of 0xFF in
+// the data ends recovery early, so binary streams want crcRecords.
+// Anything that isn't a single run with at least a cluster to spare (an
+// ordinary or a full log) is left alone.  A log that turns out to be
+// empty is removed, giving its run back.
+//
+// Uses the front of the ring as scratch, so must be called before
+// start_ports().
+static void recover_log(const char *filename) {
+	FIL *fil = (FIL *) rx_buf;
+	uint8_t *sec = rx_buf + RECOVER_SCRATCH - _MAX_SS;
+	DWORD clmt[6] = { NELEMENTS(clmt) };
+
+	if (f_open(fil, filename, FA_READ | FA_WRITE | FA_OPEN_EXISTING) !=
+			FR_OK) {
+		return;
+	}
+
+	fil->cltbl = clmt;
+	FRESULT res = f_lseek(fil, CREATE_LINKMAP);
+	fil->cltbl = NULL;
+
+	FATFS *fs = fil->obj.fs;
+	FSIZE_t size = f_size(fil);
+	FSIZE_t limit = (FSIZE_t) clmt[1] * fs->csize * _MAX_SS;
+	FSIZE_t end = size;
+	bool ours = (res == FR_OK) && clmt[1] && !clmt[3] &&
+		((limit - size) >= (FSIZE_t) fs->csize * _MAX_SS);
+
+	// clmt: table size, then (cluster count, first cluster) per run, 0
+	if (ours && cfg_crc_records) {
+		DWORD base = fs->database + (clmt[2] - 2) * fs->csize;
+
+		end = recover_records(fs, base, size, limit, sec);
+	} else if (ours) {
+		DWORD base = fs->database + (clmt[2] - 2) * fs->csize;
+
+		for (FSIZE_t off = size - size % _MAX_SS; off < limit;
+				off += _MAX_SS) {
+			if (disk_read(fs->drv, sec, base + off / _MAX_SS, 1) !=
+					RES_OK) {
+				break;
+			}
+
+			unsigned int len = sector_data_len(sec);
+
+			if (off + len > end) {
+				end = off + len;
+			}
+
+			if (len < _MAX_SS) {
+				break;
+			}
+		}
+	}
+
+	if (ours && (end == 0)) {
+		f_close(fil);
+		f_unlink(filename);
+		return;
+	}
+
+	if (ours) {
+		// Within the allocated run, so this only moves the size
+		if ((f_lseek(fil, end) == FR_OK) && (end > size)) {
+			recovered_files++;
+			recovered_bytes += end - size;
+		}
+
+		// The run past the data isn't going to be written now
+		f_truncate(fil);
+	}
 
-			res = f_write(&log_file, pos, amt, &written);
+	f_close(fil);
+}
+
+// Remove the file if it holds no more than a header of header_len bytes
+static void remove_if_empty(const char *filename, FSIZE_t header_len) {
+	FILINFO fno;
+
+	if ((f_stat(filename, &fno) == FR_OK) && (fno.fsize <= header_len)) {
+		f_unlink(filename);
+	}
+}
+
+// The last two runs' logs: when rotating, the last log may be a next log
+// prepared but never written.  Logging only ever ends with the power, so
+// there's no shutdown to tidy up at; instead, once recovered (which gives
+// back their runs), a run's logs that never got any data are removed
+// here, and its time index if no entries made it in.
+static void recover_logs(log_name_t previous[2]) {
+	static const uint8_t port_numbers[] = { 2, 6 };
+	char filename[sizeof(LOGNAME_MAX) + 2];
+
+	for (int run = 0; run < 2; run++) {
+		if (!previous[run][0]) {
+			continue;
+		}
 
-			if (res != FR_OK) {
-				// . .-. .-.
-				led_panic("WERR");
+		if (recovering()) {
+			recover_log(previous[run]);
+		}
+
+		remove_if_empty(previous[run], 0);
+
+		for (unsigned int i = 0; i < NELEMENTS(port_numbers); i++) {
+			port_log_name(filename, previous[run], port_numbers[i]);
+
+			if (recovering()) {
+				recover_log(filename);
 			}
 
-			if (written != amt) {
-				// ..-. ..- .-.. .-..
-				led_panic("FULL");
+			remove_if_empty(filename, 0);
+		}
+
+		strcpy(filename, previous[run]);
+		strcpy(strchr(filename, '.'), ".idx");
+		remove_if_empty(filename, sizeof(idx_header_t));
+	}
+}
+
+// Keep the sector after the end of a log's data erased, for
+// recover_log().  It lies in the log's own preallocated run, so nothing
+// else can be using it; the erase is remembered, and the sector isn't
+// erased again when the data gets there.
+static void erase_ahead(log_port_t *lp) {
+	if (lp->erase_ahead && recovering()) {
+		erase_after_data(lp->fil);
+	}
+}
+
+// f_expand() leaves a log's run as it finds it, so otherwise every sector
+// written would first have to be erased, stalling the write for up to
+// 400ms.  Instead, while the flash has nothing else to do, erase the run
+// a sector at a time up to eraseAheadBytes past the data; the writes then
+// find their sectors erased and are only page programs.  Each erase is
+// only started here: it runs on the chip while the CPU sleeps, and a
+// write that comes along meanwhile waits out just the rest of it.
+static void erase_ahead_idle(void)
+{
+	if (!cfg_erase_ahead_bytes || !flashIsReady()) {
+		return;
+	}
+
+	for (int i = 0; i < log_num_ports; i++) {
+		log_port_t *lp = &log_ports[i];
+
+		// Interleaved ports share the primary log
+		if ((!lp->erase_ahead) ||
+				((i > 0) && (lp->fil == log_ports[0].fil))) {
+			continue;
+		}
+
+		FSIZE_t next = next_sector(lp->fil);
+
+		if (lp->erased_to < next) {
+			lp->erased_to = next;
+		}
+
+		if ((lp->erased_to - next >= cfg_erase_ahead_bytes) ||
+				(lp->erased_to >= cfg_prealloc)) {
+			continue;
+		}
+
+		erase_log_sector(lp->fil, lp->erased_to);
+		lp->erased_to += _MAX_SS;
+		erases_ahead++;
+
+		return;
+	}
+}
+
+
+static void write_buf(FIL *fil, const void *buf, unsigned int len)
+{
+	UINT written;
+	uint32_t start = stats_start();
+
+	FRESULT res = f_write(fil, buf, len, &written);
+
+	uint32_t us = stats_end(STATS_WRITE, start);
+
+	if (us > write_max_us) {
+		write_max_us = us;
+	}
+
+	written_total += len;
+
+	if (res != FR_OK) {
+		// . .-. .-.
+		led_panic("WERR");
+	}
+
+	if (written != len) {
+		// ..-. ..- .-.. .-..
+		led_panic("FULL");
+	}
+}
+
+// The header of a CRC record of the segments (see log_record.h).  The CRC
+// unit's DMA reads the payload; the wait for it mostly overlaps the flash
+// still programming the last page of the previous write, which the next
+// write would wait for anyway.
+static void crc_record_hdr(log_port_t *lp, const usart_rx_iov_t *iov,
+		unsigned int iovcnt, log_record_hdr_t *hdr)
+{
+	uint32_t start = stats_start();
+
+	*hdr = (log_record_hdr_t) {
+		.magic = { LOG_RECORD_MAGIC0, LOG_RECORD_MAGIC1 },
+		.port = lp->number,
+		.seq = lp->record_seq++,
+		.us = timebase_us(),
+	};
+
+	if (cfg_compress != COMPRESS_NONE) {
+		hdr->flags |= LOG_RECORD_LZ;
+	}
+
+	if (cfg_line_stamps) {
+		hdr->flags |= LOG_RECORD_STAMPED;
+	}
+
+	if (lp->frames.emit) {
+		hdr->flags |= LOG_RECORD_FRAMES;
+	}
+
+	for (unsigned int i = 0; i < iovcnt; i++) {
+		hdr->len += iov[i].len;
+	}
+
+	crc_dma_begin();
+	crc_dma_feed(hdr, LOG_RECORD_CRC_HDR_LEN);
+
+	for (unsigned int i = 0; i < iovcnt; i++) {
+		crc_dma_feed(iov[i].base, iov[i].len);
+	}
+
+	hdr->crc = crc_dma_end();
+
+	stats_end(STATS_CRC, start);
+}
+
+// Write segments back to back, as one container record when ports are
+// interleaved or records are CRC checked.  The chunker aligns the total,
+// and the ring is a whole number of sectors, so when a chunk wraps the
+// first segment ends on a sector boundary too and FatFs can program both
+// segments as whole sectors straight from the ring.  (Record headers give
+// that up; the containers trade alignment for a single file or checking.)
+static void write_record(log_port_t *lp, const usart_rx_iov_t *iov,
+		unsigned int iovcnt)
+{
+	if (cfg_crc_records) {
+		log_record_hdr_t hdr;
+
+		crc_record_hdr(lp, iov, iovcnt, &hdr);
+
+		write_buf(lp->fil, &hdr, sizeof(hdr));
+	} else if (cfg_interleave_ports) {
+		unsigned int len = 0;
+
+		for (unsigned int i = 0; i < iovcnt; i++) {
+			len += iov[i].len;
+		}
+
+		uint8_t hdr[4] = {
+			CONTAINER_MAGIC,
+			lp->number,
+			len & 0xff,
+			len >> 8,
+		};
+
+		write_buf(lp->fil, hdr, sizeof(hdr));
+	}
+
+	for (unsigned int i = 0; i < iovcnt; i++) {
+		write_buf(lp->fil, iov[i].base, iov[i].len);
+	}
+}
+
+// Compress the bytes gathered for a port into one block and write it,
+// header and payload as one record.  Blocks that don't shrink are stored.
+static void write_block(log_port_t *lp)
+{
+	if (!lp->zlen) {
+		return;
+	}
+
+	lz_block_hdr_t hdr = {
+		.magic = { LZ_MAGIC0, LZ_MAGIC1 },
+		.raw_len = lp->zlen,
+	};
+	usart_rx_iov_t iov[2] = {
+		{ (const char *) &hdr, sizeof(hdr) },
+	};
+
+	uint32_t start = timebase_cycles();
+	unsigned int comp_len = lz_compress(lz_state, lp->zbuf, lp->zlen,
+			lz_out, lz_out_len);
+	lz_cycles += timebase_cycles() - start;
+
+	if (comp_len && (comp_len < lp->zlen)) {
+		hdr.method = LZ_METHOD_LZ4;
+		hdr.comp_len = comp_len;
+		iov[1].base = (const char *) lz_out;
+	} else {
+		hdr.method = LZ_METHOD_STORED;
+		hdr.comp_len = lp->zlen;
+		iov[1].base = (const char *) lp->zbuf;
+	}
+	iov[1].len = hdr.comp_len;
+
+	write_record(lp, iov, 2);
+
+	lz_in_bytes += lp->zlen;
+	lz_out_bytes += sizeof(hdr) + hdr.comp_len;
+	lp->zlen = 0;
+}
+
+// Everything logged for a port comes through here: straight out, or
+// gathered into compressBlock byte blocks when compressing.
+static void write_iov(log_port_t *lp, const usart_rx_iov_t *iov,
+		unsigned int iovcnt)
+{
+	if (cfg_compress == COMPRESS_NONE) {
+		write_record(lp, iov, iovcnt);
+		return;
+	}
+
+	for (unsigned int i = 0; i < iovcnt; i++) {
+		const char *base = iov[i].base;
+		unsigned int len = iov[i].len;
+
+		while (len) {
+			unsigned int n = MIN(len, cfg_compress_block - lp->zlen);
+
+			memcpy(lp->zbuf + lp->zlen, base, n);
+			lp->zlen += n;
+			base += n;
+			len -= n;
+
+			if (lp->zlen == cfg_compress_block) {
+				write_block(lp);
 			}
 		}
+	}
+}
 
-		led_set(false);
+// "[seconds.micros] ", seconds since the timebase started
+static int format_line_stamp(log_port_t *lp, uint32_t us, char *prefix,
+		unsigned int size)
+{
+	// A stamp can be a little older than the last one (an evicted stamp
+	// makes a line look later than it was); only a big step back is a wrap.
+	if ((us < lp->line_us_last) && ((lp->line_us_last - us) > 0x80000000u)) {
+		lp->line_us_wraps++;
+	}
+	lp->line_us_last = us;
+
+	uint64_t us64 = ((uint64_t) lp->line_us_wraps << 32) | us;
+
+	return snprintf(prefix, size, "[%8lu.%06lu] ",
+			(unsigned long) (us64 / 1000000),
+			(unsigned long) (us64 % 1000000));
+}
+
+// Lines gathered into one record before writing.  The container length is
+// 16 bits: a RECORD_MAX chunk plus this many prefixes still fits.
+#define LINE_BATCH 64
+#define LINE_PREFIX_MAX 24
+
+static usart_rx_iov_t line_iov[2 * LINE_BATCH];
+static char line_prefix[LINE_BATCH][LINE_PREFIX_MAX];
+
+// Line framing: prefix every line with the time its first byte arrived.
+// The prefixes are formatted into line_prefix[] and the chunk goes out as
+// one record of prefixes and line bodies (LINE_BATCH lines at a time), so
+// a CRC or container header isn't paid per line.  The bodies stay in the
+// ring until written, but that doesn't make them zero-copy: each is its
+// own f_write, and between prefixes they rarely cover a whole sector, so
+// FatFs copies them into its sector buffer like any other short write.
+// A line split by the end of the ring or the end of the chunk just
+// continues in the next piece.
+static void write_lines(log_port_t *lp, const usart_rx_lease_t *chunk)
+{
+	unsigned int off = 0;
+	unsigned int iovcnt = 0;
+	unsigned int prefixes = 0;
+
+	for (unsigned int i = 0; i < chunk->iovcnt; i++) {
+		const char *base = chunk->iov[i].base;
+		unsigned int len = chunk->iov[i].len;
+
+		while (len) {
+			// A piece takes a prefix and a body at most
+			if ((prefixes == LINE_BATCH) ||
+					(iovcnt + 2 > 2 * LINE_BATCH)) {
+				write_iov(lp, line_iov, iovcnt);
+				iovcnt = 0;
+				prefixes = 0;
+			}
+
+			if (lp->at_line_start) {
+				char *prefix = line_prefix[prefixes++];
+
+				line_iov[iovcnt].base = prefix;
+				line_iov[iovcnt].len = format_line_stamp(lp,
+						usart_rx_stamp(chunk, off),
+						prefix, LINE_PREFIX_MAX);
+				iovcnt++;
+			}
+
+			unsigned int n = line_scan_nl(base, len);
+
+			lp->at_line_start = (n < len);
+			if (n < len) {
+				n++;	// Keep the newline with its line
+			}
+
+			line_iov[iovcnt].base = base;
+			line_iov[iovcnt].len = n;
+			iovcnt++;
+
+			base += n;
+			len -= n;
+			off += n;
+		}
+	}
+
+	if (iovcnt) {
+		write_iov(lp, line_iov, iovcnt);
+	}
+}
+
+// Frame sync emits runs of good frames here when dropping garbage
+static void write_frames(void *ctx, const uint8_t *buf, unsigned int len)
+{
+	usart_rx_iov_t iov = { (const char *) buf, len };
+
+	write_iov(ctx, &iov, 1);
+}
+
+static void write_index(log_port_t *lp, const usart_rx_lease_t *chunk)
+{
+	if ((!idx_fil) || (!chunk->stamp_ahead)) {
+		return;
+	}
+
+	idx_entry_t entry = {
+		.port = lp->number,
+		.offset = lp->stream_offset + chunk->stamp_ahead,
+		.us = chunk->stamp_us,
+	};
+
+	write_buf(idx_fil, &entry, sizeof(entry));
+}
+
+static void open_index(FIL *fil, const char *primary)
+{
+	char filename[sizeof(LOGNAME_MAX)];
+	idx_header_t hdr = {
+		.magic = IDX_MAGIC,
+		.version = IDX_VERSION,
+		.entry_size = sizeof(idx_entry_t),
+	};
+
+	strcpy(filename, primary);
+	strcpy(strchr(filename, '.'), ".idx");
+
+	if (f_open(fil, filename, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
+	}
+
+	write_buf(fil, &hdr, sizeof(hdr));
+}
+
+static void write_text(log_port_t *lp, const char *text, unsigned int len)
+{
+	usart_rx_iov_t iov = { text, len };
+
+	write_iov(lp, &iov, 1);
+}
+
+static void write_uerr_marker(log_port_t *lp)
+{
+	char marker[64];
+	usart_line_errors_t errs;
+
+	usart_get_line_errors(lp->port, &errs);
+
+	if ((errs.fe == lp->markers_errs.fe) &&
+			(errs.ne == lp->markers_errs.ne) &&
+			(errs.ore == lp->markers_errs.ore)) {
+		return;
+	}
+
+	if ((HAL_GetTick() - lp->markers_errs_time) < MARKER_UERR_PERIOD_MS) {
+		return;
+	}
+
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@UERR fe=%u ne=%u ore=%u\n",
+			errs.fe, errs.ne, errs.ore);
+
+	write_text(lp, marker, len);
+
+	lp->markers_errs = errs;
+	lp->markers_errs_time = HAL_GetTick();
+}
+
+// Written when a holdoff starts, then at most once a period while it lasts.
+static void write_flow_marker(log_port_t *lp)
+{
+	char marker[64];
+	usart_flow_stats_t flow;
+
+	usart_get_flow_stats(lp->port, &flow);
+
+	if (flow.held_ms == lp->markers_flow.held_ms) {
+		return;
+	}
+
+	if ((flow.holdoffs == lp->markers_flow.holdoffs) &&
+			((HAL_GetTick() - lp->markers_flow_time) <
+			 MARKER_UERR_PERIOD_MS)) {
+		return;
+	}
+
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@FLOW n=%u ms=%lu\n",
+			flow.holdoffs, (unsigned long) flow.held_ms);
+
+	write_text(lp, marker, len);
+
+	lp->markers_flow = flow;
+	lp->markers_flow_time = HAL_GetTick();
+}
+
+static void write_frames_marker(log_port_t *lp)
+{
+	char marker[80];
+	const frame_sync_stats_t *st = &lp->frames.stats;
+
+	if (!memcmp(st, &lp->markers_frames, sizeof(*st))) {
+		return;
+	}
+
+	if ((HAL_GetTick() - lp->markers_frames_time) < MARKER_UERR_PERIOD_MS) {
+		return;
+	}
+
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@FSYN good=%lu bad=%lu unchk=%lu junk=%lu\n",
+			(unsigned long) st->good, (unsigned long) st->bad,
+			(unsigned long) st->unchecked,
+			(unsigned long) st->garbage);
+
+	write_text(lp, marker, len);
+
+	lp->markers_frames = *st;
+	lp->markers_frames_time = HAL_GetTick();
+}
+
+// In-band markers are single text lines starting with "@@" so they can be
+// grepped out of a log:
+//   @@DROP off=<stream offset of the gap> n=<bytes dropped>
+//   @@UERR fe=<framing> ne=<noise> ore=<overrun>   (cumulative)
+//   @@FLOW n=<RTS holdoffs> ms=<time RTS was held off>   (cumulative)
+//   @@FSYN good= bad= unchk= junk=<bytes>   (cumulative)
+//   @@IDLE pct=<CPU idle % over the last period>   (primary log only)
+//   @@RCVR files=<logs fixed up> n=<bytes recovered>   (at start, primary
+//                                    log only; for the previous run's logs)
+//   @@COMP in=<bytes> out=<bytes> cpb=<CPU cycles a byte>
+//          maxbaud=<baud the compressor alone could keep up with>
+//                                    (cumulative, primary log only)
+//   @@SYNC full=<f_syncs> data=<data-only syncs> erases=<flash sectors>
+//                                    (cumulative, primary log only)
+// Drops must be collected even when markers are off, or the chunker would
+// keep stopping at the gap.
+static void write_markers(log_port_t *lp)
+{
+	char marker[64];
+	unsigned int dropped;
+
+	if (usart_rx_take_drop(lp->port, &dropped)) {
+		if (cfg_inband_markers) {
+			int len = snprintf(marker, sizeof(marker),
+					"\n@@DROP off=%lu n=%u\n",
+					(unsigned long) lp->stream_offset,
+					dropped);
+
+			write_text(lp, marker, len);
+		}
+
+		lp->stream_offset += dropped;
+		lp->rx_total += dropped;
+		lp->spilled_total += dropped;
+	}
+
+	if (!cfg_inband_markers) {
+		return;
+	}
+
+	write_uerr_marker(lp);
+
+	if (cfg_flow_control) {
+		write_flow_marker(lp);
+	}
+
+	if (cfg_frame_sync) {
+		write_frames_marker(lp);
+	}
+}
+
+static unsigned int clamp(unsigned int v, unsigned int lo, unsigned int hi)
+{
+	if (v < lo) return lo;
+	if (v > hi) return hi;
+	return v;
+}
+
+// Pick the chunk sizes and timeout for a port.  Bigger writes amortise
+// FatFs and flash overhead better, so write the biggest chunk we can while
+// keeping the ring below the safety margin: whatever arrives during a
+// (worst recent) write lands on top of the chunk being written, so
+//   chunk + rate * write latency <= ringSafety% of the ring.
+// The timeout is about the time the rate takes to fill a chunk, so slow
+// ports write full chunks instead of many small ones and sync less.
+static void chunk_control(log_port_t *lp)
+{
+	uint32_t now = HAL_GetTick();
+	uint32_t elapsed = now - lp->rate_time;
+
+	if (elapsed >= RATE_PERIOD_MS) {
+		uint32_t total = lp->stream_offset + usart_rx_used(lp->port);
+		uint32_t sample = (uint64_t) (total - lp->rate_total) * 1000 /
+			elapsed;
+
+		// EWMA, 1/4 weight on the new sample
+		lp->rate = lp->rate - lp->rate / 4 + sample / 4;
+		lp->rate_total = total;
+		lp->rate_time = now;
+	}
+
+	unsigned int safety = lp->ring_len / 100 * cfg_ring_safety;
+	unsigned int backlog = (uint64_t) lp->rate * lp->write_ms / 1000;
+	unsigned int chunk = 0;
+
+	if (backlog < safety) {
+		chunk = safety - backlog;
+		chunk -= chunk % CHUNK_ALIGN;
+	}
+
+	chunk = clamp(chunk, cfg_chunk_min, cfg_chunk_max);
+
+	// Already past the margin: take whatever is there
+	if (usart_rx_used(lp->port) > safety) {
+		lp->chunk_min = CHUNK_ALIGN;
+	} else {
+		lp->chunk_min = chunk;
+	}
+
+	lp->chunk_max = chunk;
+
+	uint32_t fill_ms = lp->rate ? (uint64_t) chunk * 1000 / lp->rate :
+		cfg_chunk_timeout_max;
+
+	lp->chunk_timeout = clamp(fill_ms, cfg_chunk_timeout_min,
+			cfg_chunk_timeout_max);
+}
+
+static void write_sync_marker(void)
+{
+	char marker[80];
+
+	if ((syncs_full == sync_marked_full) &&
+			(syncs_data == sync_marked_data)) {
+		return;
+	}
+
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@SYNC full=%lu data=%lu erases=%lu\n",
+			(unsigned long) syncs_full, (unsigned long) syncs_data,
+			(unsigned long) USER_erase_count);
+
+	write_text(&log_ports[0], marker, len);
+
+	sync_marked_full = syncs_full;
+	sync_marked_data = syncs_data;
+}
+
+// Sectors erased ahead, and erased on the write path after all, and the
+// worst f_write() since the last marker
+static void write_erase_marker(void)
+{
+	char marker[80];
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@ERAS ahead=%lu inline=%lu maxwrite_us=%lu\n",
+			(unsigned long) erases_ahead,
+			(unsigned long) USER_write_erase_count,
+			(unsigned long) write_max_us);
+
+	write_text(&log_ports[0], marker, len);
+
+	write_max_us = 0;
+}
+
+static void write_comp_marker(void)
+{
+	char marker[96];
+
+	if ((cfg_compress == COMPRESS_NONE) || (!lz_in_bytes) ||
+			(lz_in_bytes == lz_marked_in)) {
+		return;
+	}
+
+	uint32_t cpb100 = lz_cycles * 100 / lz_in_bytes;
+	uint32_t max_baud = lz_cycles ?
+		(uint64_t) SystemCoreClock * 10 * lz_in_bytes / lz_cycles : 0;
+
+	int len = snprintf(marker, sizeof(marker),
+			"\n@@COMP in=%lu out=%lu cpb=%lu.%02lu maxbaud=%lu\n",
+			(unsigned long) lz_in_bytes,
+			(unsigned long) lz_out_bytes,
+			(unsigned long) (cpb100 / 100),
+			(unsigned long) (cpb100 % 100),
+			(unsigned long) max_baud);
+
+	write_text(&log_ports[0], marker, len);
+
+	lz_marked_in = lz_in_bytes;
+}
+
+static void write_idle_marker(void)
+{
+	char marker[32];
+	uint32_t now = timebase_us();
+	uint32_t elapsed = now - idle_marked_time;
+
+	if (elapsed < MARKER_IDLE_PERIOD_MS * 1000) {
+		return;
+	}
+
+	unsigned int pct = (uint64_t) (idle_us - idle_marked_us) * 100 /
+		elapsed;
+
+	int len = snprintf(marker, sizeof(marker), "\n@@IDLE pct=%u\n", pct);
+
+	write_text(&log_ports[0], marker, len);
+
+	idle_marked_us = idle_us;
+	idle_marked_time = now;
+
+	write_sync_marker();
+	write_erase_marker();
+	write_comp_marker();
+}
+
+static bool stats_due(void)
+{
+	uint32_t rx = 0;
+
+	for (int i = 0; i < log_num_ports; i++) {
+		rx += log_ports[i].rx_total;
+	}
+
+	return stats_fil && (rx != stats_rx) &&
+		((HAL_GetTick() - stats_time) >= STATS_PERIOD_MS);
+}
+
+static void write_stats_text(const char *text, int len)
+{
+	write_buf(stats_fil, text, MIN(len, STATS_LINE_MAX - 1));
+}
+
+// See STATS_PERIOD_MS
+static void write_stats(const char *primary)
+{
+	char filename[sizeof(LOGNAME_MAX)];
+	char line[STATS_LINE_MAX];
+	uint32_t start = stats_start();
+	uint32_t rx = 0;
+
+	strcpy(filename, primary);
+	strcpy(strchr(filename, '.'), ".sts");
+
+	// Overwritten in place rather than recreated, which would free and
+	// allocate its cluster again each time
+	if (f_open(stats_fil, filename, FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
+	}
+
+	write_stats_text(line, snprintf(line, sizeof(line),
+				"uptime_ms=%lu written=%lu stats_us=%lu\n",
+				(unsigned long) HAL_GetTick(),
+				(unsigned long) written_total,
+				(unsigned long) stats_us));
+
+	for (int i = 0; i < log_num_ports; i++) {
+		log_port_t *lp = &log_ports[i];
+
+		write_stats_text(line, snprintf(line, sizeof(line),
+					"port=%u rx=%lu spilled=%lu synced=%lu "
+					"ring_high=%u ring=%u\n",
+					lp->number,
+					(unsigned long) lp->rx_total,
+					(unsigned long) lp->spilled_total,
+					(unsigned long) lp->synced_total,
+					lp->ring_high, lp->ring_len));
+
+		rx += lp->rx_total;
+	}
+
+	for (int i = 0; i < STATS_NUM_HIST; i++) {
+		write_stats_text(line, stats_format_hist(line, sizeof(line), i));
+	}
+
+	if ((f_truncate(stats_fil) != FR_OK) || (f_close(stats_fil) != FR_OK)) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	stats_rx = rx;
+	stats_time = HAL_GetTick();
+	stats_us += stats_elapsed_us(start);
+}
+
+static bool sync_due(log_port_t *lp)
+{
+	switch (cfg_sync_policy) {
+	case SYNC_BYTES:
+		return (lp->stream_offset - lp->synced_offset) >= cfg_sync_bytes;
+	case SYNC_TIME:
+		return (HAL_GetTick() - lp->synced_time) >= cfg_sync_period;
+	default:
+		return false;
+	}
+}
+
+// Get what's been logged onto the flash.  A full sync also updates the
+// directory entry and FAT; a data-only sync just programs the partly
+// filled sector at the end of the file, so the data survives a power cut
+// but the file's size doesn't (see f_datasync()).  Either is free when
+// there's nothing new.
+static void sync_log(log_port_t *lp, bool full)
+{
+	FRESULT res;
+
+	// A partial block waits no longer than the buffers do
+	if (cfg_compress != COMPRESS_NONE) {
+		write_block(lp);
+	}
+
+	uint32_t start = stats_start();
+
+	// Interleaved ports share the primary log
+	log_port_t *owner = (lp->fil == log_ports[0].fil) ? &log_ports[0] : lp;
+
+	if (full) {
+		res = f_sync(lp->fil);
+
+		if ((res == FR_OK) && idx_fil) {
+			res = f_sync(idx_fil);
+		}
+
+		owner->on_flash = f_tell(lp->fil);
+		lp->synced_total += lp->stream_offset - lp->synced_offset;
+		lp->synced_offset = lp->stream_offset;
+		lp->synced_time = HAL_GetTick();
+		syncs_full++;
+	} else if (cfg_sync_data_only) {
+		res = f_datasync(lp->fil);
+
+		if ((res == FR_OK) && idx_fil) {
+			res = f_datasync(idx_fil);
+		}
+
+		owner->on_flash = f_tell(lp->fil);
+
+		syncs_data++;
+	} else {
+		return;
+	}
+
+	stats_end(STATS_SYNC, start);
+
+	if (res != FR_OK) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	if (full && stats_due()) {
+		write_stats(log_name);
+	}
+}
+
+// Trigger capture (see trigger_mode()).  While waiting for a trigger,
+// each port's ring is scanned and handed straight back, but its bytes
+// stay where they are, behind the reader, until reception comes round to
+// them again.  A trigger takes back as many as preTriggerSeconds' worth at
+// the port's baud rate (usart_rx_rewind()) and logs on from there, so the
+// window before a trigger is what the ring can hold: ~90KB, 8s at 115200
+// baud.  TRIGGER_GUARD of the ring stays free for what arrives meanwhile.
+#define TRIGGER_GUARD (2 * CHUNK_ALIGN)
+
+static pattern_t *trigger_pat;
+static volatile bool trigger_pin_fired;
+static bool capturing;
+static uint32_t capture_end;	// tick
+static unsigned int triggers;
+
+// Spill (triggerSpillBytes): the primary port's bytes, while waiting for a
+// trigger, also go round SPILL.BIN, preallocated as one run, for a longer
+// window than the ring.  At a trigger it becomes logNNN.pre beside the
+// capture's logNNN.txt, and a new one is started.  Its first sector holds
+// one line, "@@PRE start=S end=E": the bytes are from S to E, or if S is
+// past E, from S to the end of the file then from SPILL_DATA to E.
+// Sectors ahead of the writer are erased while idle, as for logs; they're
+// what it overwrites next, so the window is the file less eraseAheadBytes.
+// Going round means an erase for every sector written, and a W25Q erases
+// 4KB sectors at ~90KB/s, so the spill suits slower ports; it also wears
+// the flash, where the ring alone doesn't.
+#define SPILL_NAME "SPILL.BIN"
+#define SPILL_DATA _MAX_SS
+
+static FIL *spill_fil;
+static FSIZE_t spill_size;
+static FSIZE_t spill_ahead;	// erased past the writer's next sector
+static bool spill_wrapped;
+
+// triggerSpillBytes in whole sectors, and bigger than any chunk, so
+// spill_write() can't lap itself; 0 if there's no spill
+static FSIZE_t spill_file_size(void)
+{
+	FSIZE_t size = cfg_trigger_spill;
+
+	if ((!trigger_mode()) || (!size)) {
+		return 0;
+	}
+
+	if (size < SPILL_DATA + sizeof(rx_buf)) {
+		size = SPILL_DATA + sizeof(rx_buf);
+	}
+
+	return size - size % _MAX_SS;
+}
+
+static void spill_open(void)
+{
+	FSIZE_t size = spill_file_size();
+
+	if (f_open(spill_fil, SPILL_NAME, FA_WRITE | FA_CREATE_ALWAYS) !=
+			FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
+	}
+
+	// One run, so erase_run_sector() can find its sectors
+	if (f_expand(spill_fil, size, 1) != FR_OK) {
+		// No room: carry on with the rings alone
+		f_close(spill_fil);
+		f_unlink(SPILL_NAME);
+		spill_fil = NULL;
+		return;
+	}
+
+	spill_size = size;
+	spill_ahead = 0;
+	spill_wrapped = false;
+
+	// For the header, written once
+	erase_run_sector(spill_fil, 0);
+
+	if (f_lseek(spill_fil, SPILL_DATA) != FR_OK) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+}
+
+// Start of the sector the spill writes into next
+static FSIZE_t spill_next(void)
+{
+	FSIZE_t next = next_sector(spill_fil);
+
+	return (next >= spill_size) ? SPILL_DATA : next;
+}
+
+static void spill_write(const usart_rx_lease_t *chunk)
+{
+	FSIZE_t ring = spill_size - SPILL_DATA;
+	FSIZE_t before = spill_next();
+
+	for (unsigned int i = 0; i < chunk->iovcnt; i++) {
+		const char *base = chunk->iov[i].base;
+		unsigned int len = chunk->iov[i].len;
+
+		while (len) {
+			unsigned int n = MIN(len, spill_size - f_tell(spill_fil));
+
+			write_buf(spill_fil, base, n);
+			base += n;
+			len -= n;
+
+			if (f_tell(spill_fil) == spill_size) {
+				if (f_lseek(spill_fil, SPILL_DATA) != FR_OK) {
+					// . .-. .-.
+					led_panic("WERR");
+				}
+
+				spill_wrapped = true;
+			}
+		}
+	}
+
+	// Chunks are smaller than the ring (see trigger_init()), so this
+	// can't have gone all the way round
+	FSIZE_t moved = (spill_next() + ring - before) % ring;
+
+	spill_ahead = (spill_ahead > moved) ? spill_ahead - moved : 0;
+}
+
+// See erase_ahead_idle()
+static void spill_erase_ahead_idle(void)
+{
+	FSIZE_t ring;
+
+	if ((!spill_fil) || capturing || !flashIsReady()) {
+		return;
+	}
+
+	ring = spill_size - SPILL_DATA;
+
+	if (spill_ahead + _MAX_SS > MIN((FSIZE_t) cfg_erase_ahead_bytes,
+				ring / 2)) {
+		return;
+	}
+
+	erase_run_sector(spill_fil, SPILL_DATA +
+			(spill_next() - SPILL_DATA + spill_ahead) % ring);
+	spill_ahead += _MAX_SS;
+}
+
+// Hand the spill over to the capture starting in the current log
+static void spill_persist(void)
+{
+	char filename[sizeof(LOGNAME_MAX)];
+	char header[48];
+	FSIZE_t ring = spill_size - SPILL_DATA;
+	FSIZE_t end = f_tell(spill_fil);
+	FSIZE_t start = SPILL_DATA;
+
+	// The oldest sector nothing has been erased or written over in
+	if (spill_wrapped) {
+		start = SPILL_DATA + (spill_next() - SPILL_DATA + spill_ahead) %
+			ring;
+	}
+
+	int len = snprintf(header, sizeof(header), "@@PRE start=%lu end=%lu\n",
+			(unsigned long) start, (unsigned long) end);
+
+	if (f_lseek(spill_fil, 0) != FR_OK) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	write_buf(spill_fil, header, len);
+
+	if ((!spill_wrapped) && ((f_lseek(spill_fil, end) != FR_OK) ||
+				(f_truncate(spill_fil) != FR_OK))) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	if (f_close(spill_fil) != FR_OK) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	strcpy(filename, log_name);
+	strcpy(strchr(filename, '.'), ".pre");
+
+	f_unlink(filename);
+
+	if (f_rename(SPILL_NAME, filename) != FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
+	}
+
+	spill_open();
+}
+
+// Position in the chunk of the byte completing a match, or -1
+static int scan_chunk(log_port_t *lp, const usart_rx_lease_t *chunk)
+{
+	unsigned int off = 0;
+
+	if (!trigger_pat) {
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < chunk->iovcnt; i++) {
+		const uint8_t *base = (const uint8_t *) chunk->iov[i].base;
+		unsigned int len = chunk->iov[i].len;
+		unsigned int skip = MIN(lp->scan_skip, len);
+
+		lp->scan_skip -= skip;
+
+		int at = pattern_scan(trigger_pat, &lp->trigger_state,
+				base + skip, len - skip);
+
+		if (at >= 0) {
+			return off + skip + at;
+		}
+
+		off += len;
+	}
+
+	return -1;
+}
+
+// A trigger: at is the port whose pattern matched, after the bytes of its
+// ring past the match, already scanned.  Starts a capture, or extends the
+// one under way.
+static void trigger(log_port_t *at, unsigned int after, const char *source)
+{
+	unsigned int pre = 0;
+
+	triggers++;
+	capture_end = HAL_GetTick() + cfg_post_trigger_secs * 1000;
+
+	if (!capturing) {
+		capturing = true;
+
+		for (int i = 0; i < log_num_ports; i++) {
+			log_port_t *lp = &log_ports[i];
+			unsigned int want = lp->baud ?
+				cfg_pre_trigger_secs * (lp->baud / 10) :
+				lp->ring_len;
+
+			if (lp == at) {
+				want += after;
+			}
+
+			// Already in the spill
+			if ((i == 0) && spill_fil) {
+				want = 0;
+			}
+
+			unsigned int r = usart_rx_rewind(lp->port, want,
+					TRIGGER_GUARD);
+
+			// The log's stream starts here
+			lp->rx_total -= r;
+			lp->rate_total += r - lp->stream_offset;
+			lp->stream_offset = 0;
+			lp->synced_offset = 0;
+			lp->scan_skip = r;
+
+			if (i == 0) {
+				pre = r;
+			}
+		}
+
+		if (spill_fil) {
+			spill_persist();
+		}
+	}
+
+	if (cfg_inband_markers) {
+		char marker[64];
+		int len = snprintf(marker, sizeof(marker),
+				"\n@@TRIG n=%u src=%s pre=%u\n", triggers,
+				source, pre);
+
+		write_text(&log_ports[0], marker, len);
+	}
+}
+
+// Waiting for a trigger: scan what's come in, paced like logging, and
+// give the ring it back (the spill gets the primary port's).
+static bool scan_port(log_port_t *lp)
+{
+	usart_rx_lease_t chunk;
+	unsigned int dropped;
+
+	if (usart_rx_take_drop(lp->port, &dropped)) {
+		lp->rx_total += dropped;
+		lp->spilled_total += dropped;
+	}
+
+	chunk_control(lp);
+
+	if (((HAL_GetTick() - lp->serviced) < lp->chunk_timeout) &&
+			!usart_rx_ready(lp->port, lp->chunk_min)) {
+		return false;
+	}
+
+	if (!usart_rx_acquire(lp->port, 0, CHUNK_ALIGN, lp->chunk_min,
+				lp->chunk_max, &chunk)) {
+		// .-.. . .- ... .
+		led_panic("LEASE");
+	}
+
+	lp->serviced = HAL_GetTick();
+
+	int at = scan_chunk(lp, &chunk);
+
+	if (spill_fil && (lp == &log_ports[0])) {
+		spill_write(&chunk);
+	}
+
+	lp->stream_offset += chunk.len;
+	lp->rx_total += chunk.len;
+
+	usart_rx_release(&chunk);
+
+	if (at >= 0) {
+		trigger(lp, chunk.len - at - 1, "pattern");
+	}
+
+	return chunk.len > 0;
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t pin)
+{
+	if (pin == GPIO_PIN_0) {
+		trigger_pin_fired = true;
+	}
+}
+
+static void trigger_init(void)
+{
+	static const uint32_t modes[] = {
+		[TRIGGER_EDGE_RISING] = GPIO_MODE_IT_RISING,
+		[TRIGGER_EDGE_FALLING] = GPIO_MODE_IT_FALLING,
+		[TRIGGER_EDGE_BOTH] = GPIO_MODE_IT_RISING_FALLING,
+	};
+
+	if (spill_fil) {
+		spill_open();
+	}
+
+	if (cfg_trigger_edge != TRIGGER_EDGE_NONE) {
+		GPIO_InitTypeDef gpio = {
+			.Pin = GPIO_PIN_0,
+			.Mode = modes[cfg_trigger_edge],
+			.Pull = GPIO_PULLUP,	// the KEY button pulls it low
+		};
+
+		__HAL_RCC_GPIOA_CLK_ENABLE();
+		HAL_GPIO_Init(GPIOA, &gpio);
+
+		HAL_NVIC_SetPriority(EXTI0_IRQn, 0, 0);
+		HAL_NVIC_EnableIRQ(EXTI0_IRQn);
+	}
+}
+
+// Service one port if it has a full chunk, or if it's gone its chunk
+// timeout without one.  Returns true if it did any IO.
+static bool service_port(log_port_t *lp)
+{
+	usart_rx_lease_t chunk;
+	int at = -1;
+
+	if (trigger_mode() && !capturing) {
+		return scan_port(lp);
+	}
+
+	write_markers(lp);
+
+	chunk_control(lp);
+
+	if (((HAL_GetTick() - lp->serviced) < lp->chunk_timeout) &&
+			!usart_rx_ready(lp->port, lp->chunk_min)) {
+		return false;
+	}
+
+	unsigned int used = usart_rx_used(lp->port);
+
+	if (used > lp->ring_high) {
+		lp->ring_high = used;
+	}
+
+	if (!usart_rx_acquire(lp->port, 0, CHUNK_ALIGN, lp->chunk_min,
+				lp->chunk_max, &chunk)) {
+		// .-.. . .- ... .
+		led_panic("LEASE");
+	}
+
+	lp->serviced = HAL_GetTick();
+
+	led_set(true);	// Illuminate LED during IO
+
+	if (!chunk.len) {
+		// If nothing has happened in a timeout, flush our
+		// buffers.
+		if (cfg_frame_sync) {
+			frame_sync_flush(&lp->frames);
+		}
+
+		sync_log(lp, (cfg_sync_policy == SYNC_IDLE) || sync_due(lp));
+	} else {
+		uint32_t start = HAL_GetTick();
+
+		// A match while capturing carries the capture on
+		if (trigger_mode()) {
+			at = scan_chunk(lp, &chunk);
+		}
+
+		if (cfg_frame_sync) {
+			for (unsigned int i = 0; i < chunk.iovcnt; i++) {
+				frame_sync_feed(&lp->frames,
+						(const uint8_t *) chunk.iov[i].base,
+						chunk.iov[i].len);
+			}
+		}
+
+		if (lp->frames.emit) {
+			// Already written, good frames only
+		} else if (cfg_line_stamps) {
+			write_lines(lp, &chunk);
+		} else {
+			write_iov(lp, chunk.iov, chunk.iovcnt);
+		}
+
+		write_index(lp, &chunk);
+
+		erase_ahead(lp);
+
+		// Remember stalls (erases) for a while: decay by 1/8 a write
+		uint32_t write_ms = HAL_GetTick() - start;
+		lp->write_ms -= lp->write_ms / 8;
+		if (write_ms > lp->write_ms) {
+			lp->write_ms = write_ms;
+		}
+
+		lp->stream_offset += chunk.len;
+		lp->rx_total += chunk.len;
+		run_bytes += chunk.len;
+		last_rx = HAL_GetTick();
+
+		if (sync_due(lp)) {
+			sync_log(lp, true);
+		}
+	}
+
+	// Written out; let reception reuse the space.
+	usart_rx_release(&chunk);
+
+	led_set(false);
+
+	if (at >= 0) {
+		trigger(lp, chunk.len - at - 1, "pattern");
+	}
+
+	return true;
+}
+
+// Power fail: the PVD interrupt fires as VDD falls through 2.9V, the
+// highest level it has.  From there the logger has what charge is left on
+// the 3.3V rail until the flash drops out (2.7V for the W25Q), so rather
+// than going through FatFs, the bytes that would be lost are programmed
+// straight into the erased pages after each log's data, where
+// recover_log() finds them at the next boot.  That is: the part of FatFs's
+// sector buffer not yet on the flash, then (logging raw bytes) what's
+// waiting in the ring, then an @@PFAIL marker.  Each page is only started
+// while the time since the interrupt is within powerFailBudgetUs.
+// Only logs allocated for recovery have erased pages to put this in.
+static volatile bool power_failing;
+static volatile uint32_t power_fail_cycles;
+
+// Where a power fail flush has got to in a log
+typedef struct pf_log_s {
+	FIL *fil;
+	FSIZE_t pos;
+	FSIZE_t limit;		// end of the pages known to be erased
+	uint32_t bytes;
+} pf_log_t;
+
+void HAL_PWR_PVDCallback(void)
+{
+	if (power_failing) {
+		return;
+	}
+
+	power_fail_cycles = timebase_cycles();
+	power_failing = true;
+
+	// Nothing more is going to get written anyway
+	for (int i = 0; i < log_num_ports; i++) {
+		usart_rx_halt(log_ports[i].port);
+	}
+}
+
+static void power_fail_init(void)
+{
+	PWR_PVDTypeDef pvd = {
+		.PVDLevel = PWR_PVDLEVEL_7,
+		// PVDO rises as VDD falls below the level
+		.Mode = PWR_PVD_MODE_IT_RISING,
+	};
+
+	if ((!cfg_power_fail_budget_us) || (!recovering())) {
+		return;
+	}
+
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_ConfigPVD(&pvd);
+	HAL_PWR_EnablePVD();
+
+	HAL_NVIC_SetPriority(PVD_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(PVD_IRQn);
+}
+
+// Program len bytes at the flush position, a page at a time, while the
+// budget and the erased pages last and the flash takes them.  Returns
+// false once they don't.
+static bool pf_program(pf_log_t *pl, const uint8_t *buf, unsigned int len)
+{
+	while (len) {
+		unsigned int n = FLASH_PAGE_SIZE - pl->pos % FLASH_PAGE_SIZE;
+
+		if (n > len) {
+			n = len;
+		}
+
+		if ((pl->pos + n > pl->limit) ||
+				(stats_elapsed_us(power_fail_cycles) >=
+				 cfg_power_fail_budget_us)) {
+			return false;
+		}
+
+		if (!flashPageProgram(log_lba(pl->fil, pl->pos) * _MAX_SS +
+					pl->pos % _MAX_SS, buf, n)) {
+			return false;
+		}
+
+		pl->pos += n;
+		pl->bytes += n;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+// The part of FatFs's sector buffer that isn't on the flash yet.  When
+// dirty, the buffer holds the sector of the last byte written; anything
+// before it, or before the last sync, already went out.
+static bool pf_program_buffer(pf_log_t *pl, FSIZE_t on_flash)
+{
+	FIL *fil = pl->fil;
+	FSIZE_t end = f_tell(fil);
+
+	if ((!(fil->flag & FA_DIRTY)) || (!end)) {
+		return true;
+	}
+
+	FSIZE_t sect = (end - 1) - (end - 1) % _MAX_SS;
+
+	pl->pos = (on_flash > sect) ? on_flash : sect;
+
+	return pf_program(pl, fil->buf + (pl->pos - sect), end - pl->pos);
+}
+
+static bool pf_program_ring(pf_log_t *pl, log_port_t *lp)
+{
+	usart_rx_lease_t lease;
+
+	// No panicking with the power going: just skip the ring
+	if (!usart_rx_acquire(lp->port, 0, 1, 0, lp->ring_len, &lease)) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < lease.iovcnt; i++) {
+		if (!pf_program(pl, (const uint8_t *) lease.iov[i].base,
+					lease.iov[i].len)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Called from the main loop once the PVD has fired, rather than from the
+// interrupt, so FatFs and the flash are between operations.  Doesn't
+// return: if the power comes back after all, the FatFs state no longer
+// matches the flash, so start over and let recovery pick the logs up.
+static void power_fail_flush(void)
+{
+	static pf_log_t logs[USART_NUM_PORTS];
+	bool raw = (cfg_compress == COMPRESS_NONE) && (!cfg_line_stamps) &&
+		(!cfg_frame_sync) && (!cfg_interleave_ports) &&
+		(!cfg_crc_records);
+	uint32_t bytes = 0;
+
+	led_set(false);
+
+	// An erase ahead or the last page of a write may be under way
+	flashWaitForReady();
+
+	for (int i = 0; i < log_num_ports; i++) {
+		log_port_t *lp = &log_ports[i];
+		pf_log_t *pl = &logs[i];
+
+		// Interleaved ports are in the primary log
+		if ((!lp->erase_ahead) ||
+				((i > 0) && (lp->fil == log_ports[0].fil))) {
+			continue;
+		}
+
+		pl->fil = lp->fil;
+		pl->pos = f_tell(lp->fil);
+		pl->limit = MIN(MAX(next_sector(lp->fil) + _MAX_SS,
+					lp->erased_to), (FSIZE_t) cfg_prealloc);
+
+		if (pf_program_buffer(pl, lp->on_flash) && raw) {
+			pf_program_ring(pl, lp);
+		}
+
+		bytes += pl->bytes;
+	}
+
+	if (logs[0].fil) {
+		char marker[48];
+		int len = snprintf(marker, sizeof(marker),
+				"\n@@PFAIL us=%lu n=%lu\n",
+				(unsigned long) stats_elapsed_us(
+					power_fail_cycles),
+				(unsigned long) bytes);
+
+		usart_rx_iov_t iov = { marker, len };
+		log_record_hdr_t hdr;
+
+		if (cfg_crc_records) {
+			crc_record_hdr(&log_ports[0], &iov, 1, &hdr);
+		}
+
+		if ((!cfg_crc_records) || pf_program(&logs[0],
+					(const uint8_t *) &hdr, sizeof(hdr))) {
+			pf_program(&logs[0], (const uint8_t *) marker, len);
+		}
+	}
+
+	flashWaitForReady();
+
+	while (__HAL_PWR_GET_FLAG(PWR_FLAG_PVDO)) {
+		// Waiting for the lights to go out
+	}
+
+	NVIC_SystemReset();
+}
+
+static bool rotating(void)
+{
+	return cfg_rotate_bytes || cfg_rotate_secs || cfg_rotate_idle_secs ||
+		trigger_mode();
+}
+
+// Open the next file of the next run.  Returns false once they're all
+// open.
+static bool prepare_next_logs(void)
+{
+	int step = next_step;
+
+	if (!rotating()) {
+		return false;
+	}
+
+	if (step == 0) {
+		next_index = log_index + 1;
+		open_log_at(next_fil[0], next_name, &next_index);
+		next_step++;
+		return true;
+	}
+
+	if (step == 1) {
+		next_erase_ahead[0] = prealloc_log(next_fil[0]);
+		next_step++;
+		return true;
+	}
+
+	step -= 2;
+
+	for (int i = 1; i < log_num_ports; i++) {
+		if (!next_fil[i]) {
+			continue;
+		}
+
+		if (step-- == 0) {
+			next_erase_ahead[i] = open_port_log(next_fil[i],
+					next_name, log_ports[i].number);
+			next_step++;
+			return true;
+		}
+	}
+
+	if (next_idx_fil && (step-- == 0)) {
+		open_index(next_idx_fil, next_name);
+		next_step++;
+		return true;
+	}
+
+	return false;
+}
+
+static bool rotate_due(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	// Never leave an empty log behind
+	if (!run_bytes) {
+		return false;
+	}
+
+	if (cfg_rotate_bytes && (run_bytes >= cfg_rotate_bytes)) {
+		return true;
+	}
+
+	if (cfg_rotate_secs && ((now - run_start) / 1000 >= cfg_rotate_secs)) {
+		return true;
+	}
+
+	if (cfg_rotate_idle_secs &&
+			((now - last_rx) / 1000 >= cfg_rotate_idle_secs)) {
+		return true;
+	}
+
+	return false;
+}
+
+// A log allocated for recovery still holds the rest of its run past the
+// data (see prealloc_log()); give that back, or every log would leave
+// preallocBytes of lost clusters behind.
+static void close_log(FIL *fil)
+{
+	if (recovering() && (f_truncate(fil) != FR_OK)) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+
+	if (f_close(fil) != FR_OK) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+}
+
+// Switch every port over to the next run's logs, which normally are open
+// already.  Stream offsets (markers, the time index) start again from 0
+// in each run.
+static void rotate_logs(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	while (prepare_next_logs()) {
+		// Rotation came round before the idle loop got there
+	}
+
+	for (int i = 0; i < log_num_ports; i++) {
+		if (cfg_compress != COMPRESS_NONE) {
+			write_block(&log_ports[i]);
+		}
+	}
+
+	if (stats_fil) {
+		write_stats(log_name);
+	}
+
+	for (int i = 0; i < log_num_ports; i++) {
+		log_port_t *lp = &log_ports[i];
+
+		if ((i == 0) || next_fil[i]) {
+			FIL *old = lp->fil;
+
+			// Truncated to its data, so each rotation gives back
+			// the rest of the outgoing log's run
+			close_log(old);
+			lp->fil = next_fil[i];
+			lp->erase_ahead = next_erase_ahead[i];
+			next_fil[i] = old;
+		} else {
+			lp->fil = log_ports[0].fil;
+			lp->erase_ahead = log_ports[0].erase_ahead;
+		}
+
+		lp->erased_to = 0;
+		lp->on_flash = 0;
+		lp->rate_total -= lp->stream_offset;
+		lp->stream_offset = 0;
+		lp->synced_offset = 0;
+		lp->synced_time = now;
+	}
+
+	if (idx_fil) {
+		FIL *old = idx_fil;
+
+		close_log(old);
+		idx_fil = next_idx_fil;
+		next_idx_fil = old;
+	}
+
+	strcpy(log_name, next_name);
+	log_index = next_index;
+	next_step = 0;
+
+	run_bytes = 0;
+	run_start = now;
+}
+
+// The post trigger window has passed: close the capture's logs, and wait
+// for the next trigger in the next ones.
+static void capture_stop(void)
+{
+	for (int i = 0; i < log_num_ports; i++) {
+		if (cfg_frame_sync) {
+			frame_sync_flush(&log_ports[i].frames);
+		}
+	}
+
+	rotate_logs();
+	capturing = false;
+}
+
+// preallocBytes can ask for more than the disk has (the default, 100MB, is
+// more than a W25Q64's 8MB), and f_expand() then fails, quietly leaving
+// logs without recovery, erase ahead or the power fail flush.  So cut it
+// down to a share of the free space: one per log allocated at once (two
+// when rotating, for the next run's), and one more for everything else.
+// The trigger spill is allocated after the logs, so its size comes off
+// the free space first.  Called once the last runs' logs have given back
+// their spare clusters.
+static void size_prealloc(void) {
+	FATFS *fs;
+	DWORD free_clst;
+	unsigned int runs = cfg_interleave_ports ? 1 : log_num_ports;
+
+	if ((!cfg_prealloc) ||
+			(f_getfree(USERPath, &free_clst, &fs) != FR_OK)) {
+		return;
+	}
+
+	if (rotating()) {
+		runs *= 2;
+	}
+
+	uint32_t cluster = (uint32_t) fs->csize * _MAX_SS;
+	uint64_t free = (uint64_t) free_clst * cluster;
+	uint64_t spill = spill_file_size();
+
+	spill += (cluster - spill % cluster) % cluster;
+
+	// If it can't fit, spill_open() does without; so do we
+	if (spill < free) {
+		free -= spill;
+	}
+
+	uint64_t share = free / (runs + 1);
+
+	share -= share % cluster;
+
+	if (cfg_prealloc > share) {
+		cfg_prealloc = share;
+	}
+}
+
+static void add_port(usart_port_e port, uint8_t number, uint32_t baud)
+{
+	log_port_t *lp = &log_ports[log_num_ports++];
+
+	lp->port = port;
+	lp->number = number;
+	lp->baud = baud;
+}
+
+// Split rx_buf between the enabled ports.  Each ring must stay a whole
+// number of CHUNK_ALIGN blocks.  Extra ports logging to their own files
+// need their own FIL (each carries a sector buffer), as does the time
+// index; those are carved from the front of rx_buf only when needed.
+static void start_ports(const char *primary, bool primary_erase_ahead)
+{
+	uint8_t *arena = rx_buf;
+	unsigned int arena_len = sizeof(rx_buf);
+
+	log_ports[0].fil = &USERFile;
+	log_ports[0].erase_ahead = primary_erase_ahead;
+
+	for (int i = 1; i < log_num_ports; i++) {
+		if (cfg_interleave_ports) {
+			log_ports[i].fil = &USERFile;
+			log_ports[i].erase_ahead = primary_erase_ahead;
+			continue;
+		}
+
+		log_ports[i].fil = (FIL *) arena;
+		arena += sizeof(FIL);
+		arena_len -= sizeof(FIL);
+	}
+
+	if (cfg_time_index) {
+		idx_fil = (FIL *) arena;
+		arena += sizeof(FIL);
+		arena_len -= sizeof(FIL);
+	}
+
+	if (cfg_stats_file) {
+		stats_fil = (FIL *) arena;
+		arena += sizeof(FIL);
+		arena_len -= sizeof(FIL);
+	}
+
+	if (cfg_trigger_pattern[0]) {
+		trigger_pat = (pattern_t *) arena;
+		arena += sizeof(pattern_t);
+		arena_len -= sizeof(pattern_t);
+	}
+
+	if (trigger_mode() && cfg_trigger_spill) {
+		spill_fil = (FIL *) arena;
+		arena += sizeof(FIL);
+		arena_len -= sizeof(FIL);
+	}
+
+	if (rotating()) {
+		for (int i = 0; i < log_num_ports; i++) {
+			if ((i > 0) && cfg_interleave_ports) {
+				break;
+			}
+
+			next_fil[i] = (FIL *) arena;
+			arena += sizeof(FIL);
+			arena_len -= sizeof(FIL);
+		}
+
+		if (cfg_time_index) {
+			next_idx_fil = (FIL *) arena;
+			arena += sizeof(FIL);
+			arena_len -= sizeof(FIL);
+		}
+	}
+
+	if (cfg_compress != COMPRESS_NONE) {
+		cfg_compress_block = clamp(cfg_compress_block, 256,
+				LZ_BLOCK_MAX);
+
+		lz_state = (lz_state_t *) arena;
+		arena += sizeof(lz_state_t);
+		arena_len -= sizeof(lz_state_t);
+
+		lz_out = arena;
+		lz_out_len = LZ_BOUND(cfg_compress_block);
+		lz_out_len += (4 - lz_out_len % 4) % 4;
+		arena += lz_out_len;
+		arena_len -= lz_out_len;
+
+		for (int i = 0; i < log_num_ports; i++) {
+			log_ports[i].zbuf = arena;
+			arena += cfg_compress_block;
+			arena_len -= cfg_compress_block;
+		}
+	}
+
+	// Round the arena start up to the next block boundary
+	unsigned int used = sizeof(rx_buf) - arena_len;
+	unsigned int pad = (CHUNK_ALIGN - used % CHUNK_ALIGN) % CHUNK_ALIGN;
+	arena += pad;
+	arena_len -= pad;
+
+	unsigned int ring_len = arena_len / log_num_ports;
+	ring_len -= ring_len % CHUNK_ALIGN;
+
+	if (cfg_crc_records) {
+		crc_dma_init();
+	} else if (cfg_interleave_ports && (cfg_chunk_max > RECORD_MAX)) {
+		cfg_chunk_max = RECORD_MAX;
+	}
+
+	if (cfg_chunk_min > cfg_chunk_max) {
+		cfg_chunk_min = cfg_chunk_max;
+	}
+
+	if (cfg_chunk_timeout_min > cfg_chunk_timeout_max) {
+		cfg_chunk_timeout_min = cfg_chunk_timeout_max;
+	}
+
+	for (int i = 0; i < log_num_ports; i++) {
+		log_port_t *lp = &log_ports[i];
+		lp->serviced = HAL_GetTick();
+		lp->rate_time = lp->serviced;
+		lp->synced_time = lp->serviced;
+		lp->at_line_start = true;
+
+		if (cfg_frame_sync) {
+			frame_sync_init(&lp->frames, cfg_frame_sync,
+					cfg_frame_drop ? write_frames : NULL, lp);
+		}
+		lp->ring_len = ring_len;
+
+		if (lp->port == USART_PORT_SPI) {
+			spi_slave_init(arena + i * ring_len, ring_len,
+					cfg_spi_mode);
+			continue;
+		}
+
+		if (early_capture && (lp->port == USART_PORT_1)) {
+			uart_stop(lp->port);
+			uart_restart(lp->port, lp->baud, arena + i * ring_len,
+					ring_len, cfg_rx_dma);
+			early_bytes = usart_rx_used(lp->port);
+		} else {
+			uart_init(lp->port, lp->baud, arena + i * ring_len,
+					ring_len, cfg_rx_dma);
+		}
+
+		// Only line stamps look up when bytes arrived
+		if (cfg_line_stamps) {
+			usart_rx_enable_stamps(lp->port);
+		}
+
+		// USART6 and the SPI slave have no RTS pin, so go without
+		if (cfg_flow_control && usart_has_rts(lp->port)) {
+			usart_enable_flow_control(lp->port,
+					ring_len / 100 * cfg_flow_high_water,
+					ring_len / 100 * cfg_flow_low_water);
+		}
+	}
+
+	// The files and the trigger pattern go in the arena, which early
+	// capture may have been using until its bytes moved to the primary
+	// port's ring just now.  The rings are all running, so nothing is lost
+	// while these open.
+	if (trigger_pat && !pattern_compile(trigger_pat, cfg_trigger_pattern,
+				strlen(cfg_trigger_pattern))) {
+		led_panic("?");
+	}
+
+	for (int i = 1; i < log_num_ports; i++) {
+		if (log_ports[i].fil != &USERFile) {
+			log_ports[i].erase_ahead = open_port_log(
+					log_ports[i].fil, primary,
+					log_ports[i].number);
+		}
+	}
+
+	if (idx_fil) {
+		open_index(idx_fil, primary);
+	}
+}
+
+// Called first thing at power on, before the USB check
+void blackbox_early_capture(void)
+{
+	early_baud = EARLY_BAUD;
+	uart_init(USART_PORT_1, early_baud, EARLY_RING, EARLY_RING_LEN, true);
+	early_capture = true;
+}
+
+// Not logging after all (USB mass storage)
+void blackbox_early_capture_stop(void)
+{
+	uart_stop(USART_PORT_1);
+	early_capture = false;
+}
+
+// Once the config is read: anything captured at another baud rate than
+// the one configured is noise, so throw it away and switch now, to still
+// capture the rest of startup.
+static void early_capture_config(void)
+{
+	if ((!early_capture) ||
+			((!cfg_use_spi) && (cfg_baudrate == early_baud))) {
+		return;
+	}
+
+	uart_stop(USART_PORT_1);
+	early_discarded = usart_rx_discard(USART_PORT_1);
+
+	if (cfg_use_spi) {
+		early_capture = false;
+		return;
+	}
+
+	early_baud = cfg_baudrate;
+	uart_restart(USART_PORT_1, early_baud, EARLY_RING, EARLY_RING_LEN,
+			true);
+}
+
+void blackbox_logging_process(void)
+{
+    
+    retUSER = f_mount(&USERFatFS, USERPath, 1);
+    if (retUSER != FR_OK)
+    {
+        led_panic("DATA ");
+    }
+    
+    process_config();
+
+    early_capture_config();
+
+    // The SPI slave takes the primary log's place; its records are tagged 0
+    if (cfg_use_spi) {
+        add_port(USART_PORT_SPI, 0, 0);
+    } else {
+        add_port(USART_PORT_1, 1, cfg_baudrate);
+    }
+
+    if (cfg_baudrate2) {
+        add_port(USART_PORT_2, 2, cfg_baudrate2);
+    }
+
+    if (cfg_baudrate6) {
+        // USART6 RX is on USART1's RTS pin
+        if (cfg_flow_control) {
+            // ..-. .-.. --- .--
+            led_panic("FLOW");
+        }
+
+        add_port(USART_PORT_6, 6, cfg_baudrate6);
+    }
+
+    log_name_t previous[2];
+    open_log(&USERFile, log_name, previous);
+
+    // Before anything else is allocated, fix up the last runs' logs
+    recover_logs(previous);
+    size_prealloc();
+
+    start_ports(log_name, prealloc_log(&USERFile));
+    run_start = HAL_GetTick();
+
+    if (trigger_mode()) {
+        trigger_init();
+    }
+
+    power_fail_init();
+
+    if (cfg_inband_markers && recovered_files) {
+        char marker[48];
+        int len = snprintf(marker, sizeof(marker),
+                "\n@@RCVR files=%u n=%lu\n",
+                recovered_files, (unsigned long) recovered_bytes);
+
+        write_text(&log_ports[0], marker, len);
+    }
+
+    if (cfg_inband_markers) {
+        char marker[48];
+        int len = snprintf(marker, sizeof(marker),
+                "\n@@OPEN entries=%u us=%lu\n",
+                open_entries, (unsigned long) open_us);
+
+        write_text(&log_ports[0], marker, len);
+    }
+
+    // first_us counts from timebase_init(), a few ms after power on
+    uint32_t first_us;
+
+    if (cfg_inband_markers && early_capture &&
+            usart_rx_first_us(USART_PORT_1, &first_us)) {
+        char marker[64];
+        int len = snprintf(marker, sizeof(marker),
+                "\n@@EARLY n=%u first_us=%lu discarded=%u\n",
+                early_bytes, (unsigned long) first_us,
+                early_discarded);
+
+        write_text(&log_ports[0], marker, len);
+    }
+
+    idle_marked_time = timebase_us();
+
+    // Round robin, starting after whichever port did IO last, so a busy
+    // port can't starve the others.  When none has anything to do, sleep
+    // until the next interrupt; see usart_rx_acquire() for why that's
+    // enough to notice data and timeouts.
+    while(1)
+    {
+		bool busy = false;
+
+		if (power_failing) {
+			power_fail_flush();
+		}
+
+		for (int i = 0; i < log_num_ports; i++) {
+			int idx = (log_next_port + i) % log_num_ports;
+
+			if (service_port(&log_ports[idx])) {
+				log_next_port = idx + 1;
+				busy = true;
+				break;
+			}
+		}
+
+		if (trigger_pin_fired) {
+			trigger_pin_fired = false;
+			trigger(NULL, 0, "pin");
+		}
+
+		if (capturing &&
+				((int32_t) (HAL_GetTick() - capture_end) >= 0)) {
+			capture_stop();
+			busy = true;
+		}
+
+		// Nothing's logged between captures
+		if (cfg_inband_markers && (!trigger_mode() || capturing)) {
+			write_idle_marker();
+		}
+
+		if (rotating() && rotate_due()) {
+			rotate_logs();
+			busy = true;
+		}
+
+		// Get the next run's logs ready while there's time
+		if (!busy && prepare_next_logs()) {
+			busy = true;
+		}
+
+		if (!busy) {
+			erase_ahead_idle();
+			spill_erase_ahead_idle();
+		}
+
+		if (!busy) {
+			uint32_t slept = timebase_us();
+
+			__WFI();
+
+			idle_us += timebase_us() - slept;
+		}
     }
 }
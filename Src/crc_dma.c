@@ -0,0 +1,126 @@
+#include "stm32f4xx_hal.h"
+#include "crc_dma.h"
+#include <string.h>
+
+#define CRC_STREAM DMA2_Stream7
+
+// Shorter runs go faster through the CPU than setting up a transfer
+#define CRC_DMA_MIN_WORDS 16
+
+// NDTR is 16 bits, counting source bytes when they're unaligned
+#define CRC_DMA_MAX_WORDS (0xffff / 4)
+
+// Bytes towards the next word, little endian
+static uint32_t carry;
+static unsigned int carry_len;
+
+void crc_dma_init(void)
+{
+	__HAL_RCC_CRC_CLK_ENABLE();
+	__HAL_RCC_DMA2_CLK_ENABLE();
+
+	CRC_STREAM->CR = 0;
+	while (CRC_STREAM->CR & DMA_SxCR_EN) {
+	}
+
+	// Memory to memory: the "peripheral" port reads the buffer, the
+	// memory port writes CRC->DR.  Lowest priority, below the USART
+	// receivers and the flash SPI on the same controller.  The FIFO
+	// (required for memory to memory) packs bytes into words when the
+	// buffer isn't aligned.
+	CRC_STREAM->M0AR = (uint32_t) &CRC->DR;
+	CRC_STREAM->FCR = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH;
+}
+
+void crc_dma_wait(void)
+{
+	while (CRC_STREAM->CR & DMA_SxCR_EN) {
+	}
+}
+
+static void crc_dma_start(const uint8_t *buf, unsigned int words)
+{
+	uint32_t cr = DMA_SxCR_DIR_1 | DMA_SxCR_PINC | DMA_SxCR_MSIZE_1;
+
+	if ((uint32_t) buf % 4) {
+		CRC_STREAM->NDTR = words * 4;
+	} else {
+		cr |= DMA_SxCR_PSIZE_1;
+		CRC_STREAM->NDTR = words;
+	}
+
+	DMA2->HIFCR = DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | DMA_HIFCR_CTEIF7 |
+		DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7;
+
+	CRC_STREAM->PAR = (uint32_t) buf;
+	CRC_STREAM->CR = cr;
+	CRC_STREAM->CR = cr | DMA_SxCR_EN;
+}
+
+void crc_dma_begin(void)
+{
+	crc_dma_wait();
+
+	CRC->CR = CRC_CR_RESET;
+	carry = 0;
+	carry_len = 0;
+}
+
+void crc_dma_feed(const void *buf, unsigned int len)
+{
+	const uint8_t *p = buf;
+
+	while (carry_len && len) {
+		carry |= (uint32_t) *p++ << (8 * carry_len);
+		len--;
+
+		if (++carry_len == 4) {
+			crc_dma_wait();
+			CRC->DR = carry;
+			carry = 0;
+			carry_len = 0;
+		}
+	}
+
+	unsigned int words = len / 4;
+
+	if (words >= CRC_DMA_MIN_WORDS) {
+		while (words) {
+			unsigned int n = (words > CRC_DMA_MAX_WORDS) ?
+				CRC_DMA_MAX_WORDS : words;
+
+			crc_dma_wait();
+			crc_dma_start(p, n);
+
+			p += n * 4;
+			words -= n;
+		}
+	} else if (words) {
+		crc_dma_wait();
+
+		while (words--) {
+			uint32_t w;
+
+			memcpy(&w, p, sizeof(w));
+			CRC->DR = w;
+			p += 4;
+		}
+	}
+
+	for (len %= 4; len; len--) {
+		carry |= (uint32_t) *p++ << (8 * carry_len++);
+	}
+}
+
+uint32_t crc_dma_end(void)
+{
+	crc_dma_wait();
+
+	if (carry_len) {
+		CRC->DR = carry;
+		carry = 0;
+		carry_len = 0;
+	}
+
+	return CRC->DR;
+}
@@ -0,0 +1,440 @@
+#include "frame_sync.h"
+#include <string.h>
+
+/* MAVLink ----------------------------------------------------------------- */
+
+#define MAVLINK_STX_V1 0xFE
+#define MAVLINK_STX_V2 0xFD
+#define MAVLINK_IFLAG_SIGNED 0x01
+#define MAVLINK_SIGNATURE_LEN 13
+
+// CRC_EXTRA seeds for the common dialect's usual telemetry, sorted by
+// msgid.  Frames of other messages keep sync by their length but are only
+// counted as unchecked.
+static const struct {
+	uint32_t msgid;
+	uint8_t extra;
+} mavlink_crc_extras[] = {
+	{ 0, 50 },
+	{ 1, 124 },
+	{ 2, 137 },
+	{ 4, 237 },
+	{ 11, 89 },
+	{ 20, 214 },
+	{ 21, 159 },
+	{ 22, 220 },
+	{ 23, 168 },
+	{ 24, 24 },
+	{ 26, 170 },
+	{ 27, 144 },
+	{ 29, 115 },
+	{ 30, 39 },
+	{ 31, 246 },
+	{ 32, 185 },
+	{ 33, 104 },
+	{ 35, 244 },
+	{ 36, 222 },
+	{ 39, 254 },
+	{ 42, 28 },
+	{ 62, 183 },
+	{ 65, 118 },
+	{ 66, 148 },
+	{ 69, 243 },
+	{ 74, 20 },
+	{ 76, 152 },
+	{ 77, 143 },
+	{ 87, 150 },
+	{ 105, 93 },
+	{ 109, 185 },
+	{ 111, 34 },
+	{ 116, 76 },
+	{ 125, 203 },
+	{ 147, 154 },
+	{ 230, 163 },
+	{ 241, 90 },
+	{ 242, 104 },
+	{ 245, 130 },
+	{ 253, 83 },
+};
+
+static bool mavlink_is_sync(uint8_t c)
+{
+	return (c == MAVLINK_STX_V1) || (c == MAVLINK_STX_V2);
+}
+
+static int mavlink_frame_len(const uint8_t *buf, unsigned int avail)
+{
+	if (buf[0] == MAVLINK_STX_V1) {
+		if (avail < 2) return -1;
+
+		return 6 + buf[1] + 2;
+	}
+
+	if (avail < 3) return -1;
+
+	if (buf[2] & ~MAVLINK_IFLAG_SIGNED) {
+		// Unknown incompatibility flag; can't be parsed
+		return 0;
+	}
+
+	return 10 + buf[1] + 2 +
+		((buf[2] & MAVLINK_IFLAG_SIGNED) ? MAVLINK_SIGNATURE_LEN : 0);
+}
+
+// CRC-16/MCRF4XX, as MAVLink's crc_accumulate()
+static inline uint16_t mavlink_crc(uint16_t crc, uint8_t c)
+{
+	uint8_t tmp = c ^ (uint8_t) crc;
+
+	tmp ^= (tmp << 4);
+
+	return (crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4);
+}
+
+static frame_check_e mavlink_check(const uint8_t *frame, unsigned int len)
+{
+	uint32_t msgid;
+	unsigned int crc_pos;
+
+	if (frame[0] == MAVLINK_STX_V1) {
+		msgid = frame[5];
+		crc_pos = 6 + frame[1];
+	} else {
+		msgid = frame[7] | (frame[8] << 8) | ((uint32_t) frame[9] << 16);
+		crc_pos = 10 + frame[1];
+	}
+
+	unsigned int lo = 0;
+	unsigned int hi = sizeof(mavlink_crc_extras) /
+		sizeof(mavlink_crc_extras[0]);
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (mavlink_crc_extras[mid].msgid < msgid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ((lo == sizeof(mavlink_crc_extras) / sizeof(mavlink_crc_extras[0]))
+			|| (mavlink_crc_extras[lo].msgid != msgid)) {
+		return FRAME_UNCHECKED;
+	}
+
+	uint16_t crc = 0xFFFF;
+
+	for (unsigned int i = 1; i < crc_pos; i++) {
+		crc = mavlink_crc(crc, frame[i]);
+	}
+
+	crc = mavlink_crc(crc, mavlink_crc_extras[lo].extra);
+
+	if ((frame[crc_pos] != (crc & 0xFF)) ||
+			(frame[crc_pos + 1] != (crc >> 8))) {
+		return FRAME_BAD;
+	}
+
+	return FRAME_GOOD;
+}
+
+const frame_proto_t frame_proto_mavlink = {
+	.name = "mavlink",
+	.is_sync = mavlink_is_sync,
+	.frame_len = mavlink_frame_len,
+	.check = mavlink_check,
+	.can_drop = true,
+};
+
+/* CRSF -------------------------------------------------------------------- */
+
+// [address] [length = type + payload + crc] [type] [payload] [crc8]
+#define CRSF_ADDR_FC 0xC8
+#define CRSF_ADDR_RADIO 0xEA
+#define CRSF_ADDR_RX 0xEC
+#define CRSF_ADDR_TX 0xEE
+#define CRSF_LEN_MIN 2
+#define CRSF_LEN_MAX 62
+
+// CRC-8/DVB-S2, polynomial 0xD5
+static const uint8_t crsf_crc8_table[256] = {
+	0x00, 0xd5, 0x7f, 0xaa, 0xfe, 0x2b, 0x81, 0x54,
+	0x29, 0xfc, 0x56, 0x83, 0xd7, 0x02, 0xa8, 0x7d,
+	0x52, 0x87, 0x2d, 0xf8, 0xac, 0x79, 0xd3, 0x06,
+	0x7b, 0xae, 0x04, 0xd1, 0x85, 0x50, 0xfa, 0x2f,
+	0xa4, 0x71, 0xdb, 0x0e, 0x5a, 0x8f, 0x25, 0xf0,
+	0x8d, 0x58, 0xf2, 0x27, 0x73, 0xa6, 0x0c, 0xd9,
+	0xf6, 0x23, 0x89, 0x5c, 0x08, 0xdd, 0x77, 0xa2,
+	0xdf, 0x0a, 0xa0, 0x75, 0x21, 0xf4, 0x5e, 0x8b,
+	0x9d, 0x48, 0xe2, 0x37, 0x63, 0xb6, 0x1c, 0xc9,
+	0xb4, 0x61, 0xcb, 0x1e, 0x4a, 0x9f, 0x35, 0xe0,
+	0xcf, 0x1a, 0xb0, 0x65, 0x31, 0xe4, 0x4e, 0x9b,
+	0xe6, 0x33, 0x99, 0x4c, 0x18, 0xcd, 0x67, 0xb2,
+	0x39, 0xec, 0x46, 0x93, 0xc7, 0x12, 0xb8, 0x6d,
+	0x10, 0xc5, 0x6f, 0xba, 0xee, 0x3b, 0x91, 0x44,
+	0x6b, 0xbe, 0x14, 0xc1, 0x95, 0x40, 0xea, 0x3f,
+	0x42, 0x97, 0x3d, 0xe8, 0xbc, 0x69, 0xc3, 0x16,
+	0xef, 0x3a, 0x90, 0x45, 0x11, 0xc4, 0x6e, 0xbb,
+	0xc6, 0x13, 0xb9, 0x6c, 0x38, 0xed, 0x47, 0x92,
+	0xbd, 0x68, 0xc2, 0x17, 0x43, 0x96, 0x3c, 0xe9,
+	0x94, 0x41, 0xeb, 0x3e, 0x6a, 0xbf, 0x15, 0xc0,
+	0x4b, 0x9e, 0x34, 0xe1, 0xb5, 0x60, 0xca, 0x1f,
+	0x62, 0xb7, 0x1d, 0xc8, 0x9c, 0x49, 0xe3, 0x36,
+	0x19, 0xcc, 0x66, 0xb3, 0xe7, 0x32, 0x98, 0x4d,
+	0x30, 0xe5, 0x4f, 0x9a, 0xce, 0x1b, 0xb1, 0x64,
+	0x72, 0xa7, 0x0d, 0xd8, 0x8c, 0x59, 0xf3, 0x26,
+	0x5b, 0x8e, 0x24, 0xf1, 0xa5, 0x70, 0xda, 0x0f,
+	0x20, 0xf5, 0x5f, 0x8a, 0xde, 0x0b, 0xa1, 0x74,
+	0x09, 0xdc, 0x76, 0xa3, 0xf7, 0x22, 0x88, 0x5d,
+	0xd6, 0x03, 0xa9, 0x7c, 0x28, 0xfd, 0x57, 0x82,
+	0xff, 0x2a, 0x80, 0x55, 0x01, 0xd4, 0x7e, 0xab,
+	0x84, 0x51, 0xfb, 0x2e, 0x7a, 0xaf, 0x05, 0xd0,
+	0xad, 0x78, 0xd2, 0x07, 0x53, 0x86, 0x2c, 0xf9,
+};
+
+static bool crsf_is_sync(uint8_t c)
+{
+	return (c == CRSF_ADDR_FC) || (c == CRSF_ADDR_RADIO) ||
+		(c == CRSF_ADDR_RX) || (c == CRSF_ADDR_TX);
+}
+
+static int crsf_frame_len(const uint8_t *buf, unsigned int avail)
+{
+	if (avail < 2) return -1;
+
+	if ((buf[1] < CRSF_LEN_MIN) || (buf[1] > CRSF_LEN_MAX)) {
+		return 0;
+	}
+
+	return buf[1] + 2;
+}
+
+static frame_check_e crsf_check(const uint8_t *frame, unsigned int len)
+{
+	uint8_t crc = 0;
+
+	for (unsigned int i = 2; i < len - 1; i++) {
+		crc = crsf_crc8_table[crc ^ frame[i]];
+	}
+
+	return (crc == frame[len - 1]) ? FRAME_GOOD : FRAME_BAD;
+}
+
+const frame_proto_t frame_proto_crsf = {
+	.name = "crsf",
+	.is_sync = crsf_is_sync,
+	.frame_len = crsf_frame_len,
+	.check = crsf_check,
+	.can_drop = true,
+};
+
+/* Blackbox ---------------------------------------------------------------- */
+
+// Blackbox frames carry no checksum, and their lengths depend on field
+// encodings given in the log's own header, so only the start of each log
+// is recognised; those count as good frames, everything else as garbage.
+// Never dropped.
+#define BLACKBOX_LOG_START "H Product:Blackbox flight data recorder by Nicholas Sherlock\n"
+
+static bool blackbox_is_sync(uint8_t c)
+{
+	return c == 'H';
+}
+
+static int blackbox_frame_len(const uint8_t *buf, unsigned int avail)
+{
+	unsigned int len = sizeof(BLACKBOX_LOG_START) - 1;
+
+	if (memcmp(buf, BLACKBOX_LOG_START, (avail < len) ? avail : len)) {
+		return 0;
+	}
+
+	return (avail < len) ? -1 : (int) len;
+}
+
+static frame_check_e blackbox_check(const uint8_t *frame, unsigned int len)
+{
+	return FRAME_GOOD;
+}
+
+const frame_proto_t frame_proto_blackbox = {
+	.name = "blackbox",
+	.is_sync = blackbox_is_sync,
+	.frame_len = blackbox_frame_len,
+	.check = blackbox_check,
+	.can_drop = false,
+};
+
+/* Synchroniser ------------------------------------------------------------ */
+
+static const frame_proto_t *const frame_protos[] = {
+	&frame_proto_mavlink,
+	&frame_proto_crsf,
+	&frame_proto_blackbox,
+};
+
+const frame_proto_t *frame_sync_find_proto(const char *name,
+		unsigned int name_len)
+{
+	for (unsigned int i = 0; i < sizeof(frame_protos) /
+			sizeof(frame_protos[0]); i++) {
+		if ((strlen(frame_protos[i]->name) == name_len) &&
+				!memcmp(frame_protos[i]->name, name, name_len)) {
+			return frame_protos[i];
+		}
+	}
+
+	return NULL;
+}
+
+void frame_sync_init(frame_sync_t *fs, const frame_proto_t *proto,
+		frame_emit_fn emit, void *ctx)
+{
+	memset(fs, 0, sizeof(*fs));
+
+	fs->proto = proto;
+	fs->emit = proto->can_drop ? emit : NULL;
+	fs->ctx = ctx;
+}
+
+// 'next' is the byte after the frame, or -1 if it hasn't arrived yet.  A
+// frame that can't be checked is only believed if another frame follows
+// it; otherwise a stray sync byte could swallow the frames behind it.
+static bool count_frame(frame_sync_t *fs, const uint8_t *frame,
+		unsigned int len, int next)
+{
+	switch (fs->proto->check(frame, len)) {
+	case FRAME_GOOD:
+		fs->stats.good++;
+		return true;
+	case FRAME_UNCHECKED:
+		if ((next >= 0) && !fs->proto->is_sync(next)) {
+			return false;
+		}
+
+		fs->stats.unchecked++;
+		return true;
+	default:
+		fs->stats.bad++;
+		return false;
+	}
+}
+
+// Skip the first carried byte, and anything after it up to the next sync
+static void carry_resync(frame_sync_t *fs)
+{
+	unsigned int i = 1;
+
+	while ((i < fs->carry_len) && !fs->proto->is_sync(fs->carry[i])) {
+		i++;
+	}
+
+	fs->stats.garbage += i;
+	fs->carry_len -= i;
+	memmove(fs->carry, fs->carry + i, fs->carry_len);
+}
+
+// Finish the carried frame from the start of buf.  Returns bytes consumed.
+// A frame is only decided once the byte after it is known (see
+// count_frame()), except when flushing at the end of the data.
+static unsigned int feed_carry(frame_sync_t *fs, const uint8_t *buf,
+		unsigned int len, bool flush)
+{
+	unsigned int i = 0;
+
+	while (fs->carry_len) {
+		int flen = fs->proto->frame_len(fs->carry, fs->carry_len);
+
+		if ((flen < 0) || ((unsigned int) flen > fs->carry_len)) {
+			if (i == len) {
+				break;
+			}
+
+			unsigned int n = (flen < 0) ? 1 : flen - fs->carry_len;
+
+			if (n > len - i) {
+				n = len - i;
+			}
+
+			memcpy(fs->carry + fs->carry_len, buf + i, n);
+			fs->carry_len += n;
+			i += n;
+			continue;
+		}
+
+		int next = -1;
+
+		if (flen && ((unsigned int) flen < fs->carry_len)) {
+			next = fs->carry[flen];
+		} else if (flen && (i < len)) {
+			next = buf[i];
+		} else if (flen && !flush) {
+			break;
+		}
+
+		if (flen && count_frame(fs, fs->carry, flen, next)) {
+			if (fs->emit) {
+				fs->emit(fs->ctx, fs->carry, flen);
+			}
+
+			// After a resync the carry can hold more than the frame
+			fs->carry_len -= flen;
+			memmove(fs->carry, fs->carry + flen, fs->carry_len);
+		} else {
+			carry_resync(fs);
+		}
+	}
+
+	return i;
+}
+
+// The scan loop is the per-byte cost: garbage is skipped a byte at a time
+// with one is_sync() test, and frames are stepped over by their length
+// after one pass for the checksum.
+void frame_sync_feed(frame_sync_t *fs, const uint8_t *buf, unsigned int len)
+{
+	unsigned int i = feed_carry(fs, buf, len, false);
+	unsigned int run = i;	// start of the current run of good frames
+
+	while (i < len) {
+		if (!fs->proto->is_sync(buf[i])) {
+			goto garbage;
+		}
+
+		int flen = fs->proto->frame_len(buf + i, len - i);
+
+		if ((flen < 0) || ((unsigned int) flen >= len - i)) {
+			// Cut by the end of the piece, or no byte after it
+			// yet; finish it next time
+			fs->carry_len = len - i;
+			memcpy(fs->carry, buf + i, fs->carry_len);
+			break;
+		}
+
+		if (flen && count_frame(fs, buf + i, flen, buf[i + flen])) {
+			i += flen;
+			continue;
+		}
+
+garbage:
+		if (fs->emit && (run < i)) {
+			fs->emit(fs->ctx, buf + run, i - run);
+		}
+
+		fs->stats.garbage++;
+		i++;
+		run = i;
+	}
+
+	if (fs->emit && (run < i)) {
+		fs->emit(fs->ctx, buf + run, i - run);
+	}
+}
+
+// Decide whatever complete frames are being held back for want of the
+// byte after them; call when the stream has gone quiet.
+void frame_sync_flush(frame_sync_t *fs)
+{
+	feed_carry(fs, NULL, 0, true);
+}
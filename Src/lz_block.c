@@ -0,0 +1,230 @@
+#include "lz_block.h"
+#include <string.h>
+
+// LZ4 block format: a sequence is a token (literal count << 4 | match
+// length - 4, 15 meaning "more in following bytes"), the literals, a 16 bit
+// little endian offset back to the match, then the extra match length.
+// The block ends with a sequence of literals only.  A match may not start
+// in the last 12 bytes, and the last 5 bytes are always literals.
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+
+// Skip ahead faster through data that isn't matching
+#define SKIP_SHIFT 6
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline unsigned int hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static uint8_t *put_len(uint8_t *op, unsigned int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+
+	*op++ = len;
+
+	return op;
+}
+
+// Token, extra literal length and the literals themselves
+static uint8_t *put_literals(uint8_t *op, const uint8_t *lit,
+		unsigned int lit_len)
+{
+	uint8_t *token = op++;
+
+	if (lit_len >= 15) {
+		*token = 15 << 4;
+		op = put_len(op, lit_len - 15);
+	} else {
+		*token = lit_len << 4;
+	}
+
+	memcpy(op, lit, lit_len);
+
+	return op + lit_len;
+}
+
+unsigned int lz_compress(lz_state_t *st, const uint8_t *in, unsigned int len,
+		uint8_t *out, unsigned int out_max)
+{
+	const uint8_t *ip = in;
+	const uint8_t *anchor = in;
+	const uint8_t *end = in + len;
+	uint8_t *op = out;
+	uint8_t *oend = out + out_max;
+
+	if (len > LZ_BLOCK_MAX) {
+		return 0;
+	}
+
+	memset(st->table, 0, sizeof(st->table));
+
+	if (len > MF_LIMIT) {
+		const uint8_t *mf_limit = end - MF_LIMIT;
+		const uint8_t *match_limit = end - LAST_LITERALS;
+
+		ip++;
+
+		while (ip < mf_limit) {
+			uint32_t seq = read32(ip);
+			unsigned int h = hash4(seq);
+			const uint8_t *ref = in + st->table[h];
+
+			st->table[h] = ip - in;
+
+			if ((ref >= ip) || (read32(ref) != seq)) {
+				ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+				continue;
+			}
+
+			// Extend backwards over literals we'd otherwise emit
+			while ((ip > anchor) && (ref > in) && (ip[-1] == ref[-1])) {
+				ip--;
+				ref--;
+			}
+
+			const uint8_t *mp = ip + MIN_MATCH;
+			const uint8_t *rp = ref + MIN_MATCH;
+
+			while ((mp < match_limit) && (*mp == *rp)) {
+				mp++;
+				rp++;
+			}
+
+			unsigned int lit_len = ip - anchor;
+			unsigned int match_len = mp - ip - MIN_MATCH;
+			unsigned int offset = ip - ref;
+
+			if ((op + 1 + lit_len / 255 + 1 + lit_len + 2 +
+						match_len / 255 + 1) > oend) {
+				return 0;
+			}
+
+			uint8_t *token = op;
+
+			op = put_literals(op, anchor, lit_len);
+
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+
+			if (match_len >= 15) {
+				*token |= 15;
+				op = put_len(op, match_len - 15);
+			} else {
+				*token |= match_len;
+			}
+
+			// Seed the table from inside the match too; cheap, and
+			// catches repeats that start one record later.
+			if (mp - 2 > in) {
+				st->table[hash4(read32(mp - 2))] = mp - 2 - in;
+			}
+
+			ip = mp;
+			anchor = ip;
+		}
+	}
+
+	unsigned int lit_len = end - anchor;
+
+	if ((op + 1 + lit_len / 255 + 1 + lit_len) > oend) {
+		return 0;
+	}
+
+	op = put_literals(op, anchor, lit_len);
+
+	return op - out;
+}
+
+int lz_decompress(const uint8_t *in, unsigned int len, uint8_t *out,
+		unsigned int out_max)
+{
+	const uint8_t *ip = in;
+	const uint8_t *iend = in + len;
+	uint8_t *op = out;
+	uint8_t *oend = out + out_max;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		unsigned int lit_len = token >> 4;
+
+		if (lit_len == 15) {
+			unsigned int b;
+
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+
+				b = *ip++;
+				lit_len += b;
+			} while (b == 255);
+		}
+
+		if ((lit_len > (unsigned int) (iend - ip)) ||
+				(lit_len > (unsigned int) (oend - op))) {
+			return -1;
+		}
+
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		// The last sequence has no match
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+
+		unsigned int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		unsigned int match_len = (token & 15);
+
+		if (match_len == 15) {
+			unsigned int b;
+
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+
+				b = *ip++;
+				match_len += b;
+			} while (b == 255);
+		}
+
+		match_len += MIN_MATCH;
+
+		if ((offset == 0) || (offset > (unsigned int) (op - out)) ||
+				(match_len > (unsigned int) (oend - op))) {
+			return -1;
+		}
+
+		// Byte at a time: the match may overlap what it's copying
+		const uint8_t *ref = op - offset;
+
+		while (match_len--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - out;
+}
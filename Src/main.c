@@ -25,6 +25,7 @@
 #include "bf_flash_w25q.h"
 #include "led.h"
 #include "blackbox_logging.h"
+#include "timebase.h"
 #include <stdbool.h>
 
 /* Private includes ----------------------------------------------------------*/
@@ -88,6 +89,11 @@ int main(void)
 
 	/* Initialize all configured peripherals */
 	led_init();
+
+	// Start capturing straight away; the USB check alone takes a second
+	timebase_init();
+	blackbox_early_capture();
+
 	MX_USB_DEVICE_Init();
 	// MX_SPI_DMA_Init();
 	MX_FATFS_Init();    
@@ -99,6 +105,8 @@ int main(void)
     }
     else
     {        
+        blackbox_early_capture_stop();
+
         while (1)
         {
             HAL_Delay(1000);
@@ -0,0 +1,179 @@
+#include "pattern.h"
+#include <string.h>
+
+static int hex_digit(char c)
+{
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	}
+
+	if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	}
+
+	if ((c >= 'A') && (c <= 'F')) {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+// The byte at *pos (an escape or a plain byte); advances *pos past it.
+// Returns -1 if it's malformed.
+static int parse_byte(const char *src, unsigned int len, unsigned int *pos)
+{
+	char c = src[(*pos)++];
+
+	if (c != '\\') {
+		return (uint8_t) c;
+	}
+
+	if (*pos >= len) {
+		return -1;
+	}
+
+	c = src[(*pos)++];
+
+	switch (c) {
+	case 'n':
+		return '\n';
+	case 'r':
+		return '\r';
+	case 't':
+		return '\t';
+	case '0':
+		return 0;
+	case 'x':
+		if (*pos + 2 > len) {
+			return -1;
+		}
+
+		int hi = hex_digit(src[*pos]);
+		int lo = hex_digit(src[*pos + 1]);
+
+		if ((hi < 0) || (lo < 0)) {
+			return -1;
+		}
+
+		*pos += 2;
+
+		return (hi << 4) | lo;
+	default:
+		return (uint8_t) c;
+	}
+}
+
+// A [...] class; *pos is just past the '['
+static bool parse_class(pattern_t *pat, uint32_t bit, const char *src,
+		unsigned int len, unsigned int *pos)
+{
+	bool set[256] = { false };
+	bool negate = false;
+
+	if ((*pos < len) && (src[*pos] == '^')) {
+		negate = true;
+		(*pos)++;
+	}
+
+	while ((*pos < len) && (src[*pos] != ']')) {
+		int lo = parse_byte(src, len, pos);
+		int hi = lo;
+
+		if ((*pos + 1 < len) && (src[*pos] == '-') &&
+				(src[*pos + 1] != ']')) {
+			(*pos)++;
+			hi = parse_byte(src, len, pos);
+		}
+
+		if ((lo < 0) || (hi < lo)) {
+			return false;
+		}
+
+		for (int c = lo; c <= hi; c++) {
+			set[c] = true;
+		}
+	}
+
+	if (*pos >= len) {
+		return false;	// No closing ]
+	}
+
+	(*pos)++;
+
+	for (int c = 0; c < 256; c++) {
+		if (set[c] != negate) {
+			pat->mask[c] |= bit;
+		}
+	}
+
+	return true;
+}
+
+bool pattern_compile(pattern_t *pat, const char *src, unsigned int len)
+{
+	unsigned int pos = 0;
+	unsigned int n = 0;
+
+	memset(pat, 0, sizeof(*pat));
+
+	while (pos < len) {
+		uint32_t bit = 1u << n;
+
+		if (n >= PATTERN_MAX) {
+			return false;
+		}
+
+		if (src[pos] == '.') {
+			pos++;
+
+			for (int c = 0; c < 256; c++) {
+				pat->mask[c] |= bit;
+			}
+		} else if (src[pos] == '[') {
+			pos++;
+
+			if (!parse_class(pat, bit, src, len, &pos)) {
+				return false;
+			}
+		} else {
+			int c = parse_byte(src, len, &pos);
+
+			if (c < 0) {
+				return false;
+			}
+
+			pat->mask[c] |= bit;
+		}
+
+		n++;
+	}
+
+	if (!n) {
+		return false;
+	}
+
+	pat->match = 1u << (n - 1);
+
+	return true;
+}
+
+int pattern_scan(const pattern_t *pat, uint32_t *state, const uint8_t *buf,
+		unsigned int len)
+{
+	uint32_t s = *state;
+
+	for (unsigned int i = 0; i < len; i++) {
+		s = ((s << 1) | 1) & pat->mask[buf[i]];
+
+		if (s & pat->match) {
+			// Carry on from here next time: overlapping matches
+			// still count once each
+			*state = s & ~pat->match;
+			return i;
+		}
+	}
+
+	*state = s;
+
+	return -1;
+}
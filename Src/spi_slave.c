@@ -0,0 +1,57 @@
+#include "stm32f4xx_hal.h"
+#include "led.h"
+#include "uart.h"
+#include "spi_slave.h"
+
+SPI_HandleTypeDef hspi2;
+
+/**
+	* @brief SPI2 Initialization Function
+	* @param mode  SPI mode 0-3 (CPOL, CPHA)
+	* @retval None
+	*/
+static void MX_SPI2_Init(uint8_t mode)
+{
+	hspi2.Instance = SPI2;
+	hspi2.Init.Mode = SPI_MODE_SLAVE;
+	hspi2.Init.Direction = SPI_DIRECTION_2LINES_RXONLY;
+	hspi2.Init.DataSize = SPI_DATASIZE_8BIT;
+	hspi2.Init.CLKPolarity = (mode & 2) ? SPI_POLARITY_HIGH :
+		SPI_POLARITY_LOW;
+	hspi2.Init.CLKPhase = (mode & 1) ? SPI_PHASE_2EDGE : SPI_PHASE_1EDGE;
+	hspi2.Init.NSS = SPI_NSS_HARD_INPUT;
+	hspi2.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+	hspi2.Init.FirstBit = SPI_FIRSTBIT_MSB;
+	hspi2.Init.TIMode = SPI_TIMODE_DISABLE;
+	hspi2.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
+	hspi2.Init.CRCPolynomial = 10;
+	if (HAL_SPI_Init(&hspi2) != HAL_OK)
+	{
+		led_panic("SPI ");
+	}
+}
+
+// The master frames its writes with NSS.  Hardware NSS gates the slave, and
+// circular DMA takes every byte into the ring with no per-byte interrupt,
+// so the SPI clock is limited only by the slave's 1/2 PCLK1 maximum
+// (24 MHz here).  NSS going high ends a transfer: that's the IDLE
+// equivalent, publishing the bytes and stamping their arrival.
+void spi_slave_init(void *rx_buf, uint32_t rx_buf_len, uint8_t mode)
+{
+	MX_SPI2_Init(mode);
+
+	usart_rx_attach_dma(USART_PORT_SPI, rx_buf, rx_buf_len);
+
+	if (HAL_DMA_Start_IT(hspi2.hdmarx, (uint32_t) &SPI2->DR,
+				(uint32_t) rx_buf, rx_buf_len) != HAL_OK) {
+		led_panic("UDMA");
+	}
+
+	SET_BIT(SPI2->CR2, SPI_CR2_RXDMAEN);
+	__HAL_SPI_ENABLE(&hspi2);
+}
+
+void spi_slave_nss_IRQHandler(void)
+{
+	usart_rx_event(USART_PORT_SPI);
+}
@@ -0,0 +1,60 @@
+#include "stats.h"
+#include <stdio.h>
+
+stats_hist_t stats_hist[STATS_NUM_HIST];
+
+static const char *const stats_hist_names[STATS_NUM_HIST] = {
+	[STATS_WRITE] = "write",
+	[STATS_SYNC] = "sync",
+	[STATS_ERASE] = "erase",
+	[STATS_PROGRAM] = "program",
+	[STATS_CRC] = "crc",
+};
+
+uint32_t stats_end(stats_hist_e which, uint32_t start)
+{
+	stats_hist_t *h = &stats_hist[which];
+	uint32_t us = stats_elapsed_us(start);
+	unsigned int b = 0;
+
+	if (us >= 2) {
+		b = 31 - __CLZ(us);
+
+		if (b >= STATS_BUCKETS) {
+			b = STATS_BUCKETS - 1;
+		}
+	}
+
+	h->count++;
+	h->bucket[b]++;
+
+	if (us > h->max_us) {
+		h->max_us = us;
+	}
+
+	return us;
+}
+
+int stats_format_hist(char *buf, size_t len, stats_hist_e which)
+{
+	const stats_hist_t *h = &stats_hist[which];
+	int used = STATS_BUCKETS;
+
+	while ((used > 1) && !h->bucket[used - 1]) {
+		used--;
+	}
+
+	int n = snprintf(buf, len, "%s n=%lu max_us=%lu hist=",
+			stats_hist_names[which], (unsigned long) h->count,
+			(unsigned long) h->max_us);
+
+	for (int i = 0; i < used; i++) {
+		n += snprintf(buf + n, (n < (int) len) ? len - n : 0,
+				(i == 0) ? "%lu" : ",%lu",
+				(unsigned long) h->bucket[i]);
+	}
+
+	n += snprintf(buf + n, (n < (int) len) ? len - n : 0, "\n");
+
+	return n;
+}
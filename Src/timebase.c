@@ -0,0 +1,36 @@
+#include "stm32f4xx_hal.h"
+#include "timebase.h"
+
+/**
+	* @brief TIM5 Initialization Function
+	* The HAL TIM module isn't enabled; a free running upcounter needs
+	* nothing beyond the prescaler and reload.
+	* @param None
+	* @retval None
+	*/
+void timebase_init(void)
+{
+	uint32_t clk = HAL_RCC_GetPCLK1Freq();
+
+	// Timers on a divided APB run at twice the bus clock
+	if ((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_HCLK_DIV1) {
+		clk *= 2;
+	}
+
+	__HAL_RCC_TIM5_CLK_ENABLE();
+
+	TIM5->CR1 = 0;
+	TIM5->PSC = clk / 1000000 - 1;
+	TIM5->ARR = 0xFFFFFFFF;
+	TIM5->CNT = 0;
+
+	// Load the prescaler now rather than at the first overflow
+	TIM5->EGR = TIM_EGR_UG;
+
+	TIM5->CR1 = TIM_CR1_CEN;
+
+	// DWT cycle counter, for timebase_cycles()
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
@@ -1,144 +1,1033 @@
 #include "stm32f4xx_hal.h"
 #include "led.h"
+#include "rx_ring.h"
+#include "timebase.h"
+#include "uart.h"
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef MIN
+#define MIN(a,b) \
+	({ __typeof__ (a) _a = (a); \
+	 __typeof__ (b) _b = (b); \
+	 _a < _b ? _a : _b; })
+#endif
 
 UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
+UART_HandleTypeDef huart6;
+extern DMA_HandleTypeDef hdma_usart1_rx;
+extern DMA_HandleTypeDef hdma_usart2_rx;
+extern DMA_HandleTypeDef hdma_usart6_rx;
+extern DMA_HandleTypeDef hdma_spi2_rx;
+
+typedef struct usart_port_s {
+	UART_HandleTypeDef *huart;
+	USART_TypeDef *instance;
+	DMA_HandleTypeDef *hdma;
+
+	volatile char *rx_buf;
+	unsigned int rx_buf_len;
+	volatile unsigned int rx_spilled;
+	volatile unsigned int rx_buf_wpos;
+	volatile unsigned int rx_buf_rpos;
+	bool rx_dma;
+	bool enabled;
+
+	// Where in the ring the first byte of the current run of spills
+	// would have gone.  Chunks are not handed out across it, so the
+	// logging loop can put an overflow marker exactly at the gap.
+	volatile bool rx_drop_pending;
+	volatile unsigned int rx_drop_pos;
+	unsigned int rx_spilled_reported;
+
+	volatile usart_line_errors_t line_errors;
+
+	// Bytes received so far, as of rx_buf_wpos (i.e. the last interrupt)
+	volatile uint32_t rx_index;
+
+	// usart_rx_rewind() doesn't go back past this byte of the stream: the
+	// ring before it doesn't follow on (a spill, a restart)
+	uint32_t rx_rewind_floor;
+
+	// When the first byte came in (DMA: the first interrupt after it)
+	volatile bool rx_seen;
+	volatile uint32_t rx_first_us;
+
+	// Arrival stamps: every byte before rx_index had been received by us.
+	// Pushed from interrupts only, so stamp_head is a plain counter.
+	struct {
+		uint32_t rx_index;
+		uint32_t us;
+	} stamps[USART_RX_STAMPS];
+	volatile unsigned int stamp_head;
+
+	// RXNE mode has no IDLE event; a gap of more than two characters
+	// before a byte stands in for it.  Watching for gaps costs a timer
+	// read and a compare a byte, so it's only done once asked for.
+	bool rx_gap_stamps;
+	uint32_t rx_gap_us;
+	uint32_t rx_last_us;
 
-static volatile char *usart_rx_buf;
-static unsigned int usart_rx_buf_len; 
-static volatile unsigned int usart_rx_spilled;
-static volatile unsigned int usart_rx_buf_wpos;
-static volatile unsigned int usart_rx_buf_rpos;
-static unsigned int usart_rx_buf_next_rpos;
+	// Flow control: RTS is a GPIO, driven from the tick so it follows the
+	// ring fill level rather than the USART's one byte holding register.
+	// Deasserted (high) above rts_high_water unreleased bytes, asserted
+	// again at or below rts_low_water.
+	GPIO_TypeDef *rts_gpio;
+	uint16_t rts_pin;
+	bool flow_control;
+	unsigned int rts_high_water;
+	unsigned int rts_low_water;
+	bool rts_held;
+	uint32_t rts_held_since;
+	volatile usart_flow_stats_t flow_stats;
+
+	// Outstanding leases, oldest first.  They tile the ring contiguously
+	// from rx_buf_rpos up to rx_buf_apos; the ring is only released up
+	// to the start of the oldest lease that is still held.  A DMA overrun
+	// moves both positions on from the interrupt (see usart_rx_dma_ISR()),
+	// so they are only changed with interrupts off, and a lease's end is
+	// kept as a stream index too, to tell whether the reader is past it.
+	struct {
+		unsigned int pos;
+		unsigned int len;
+		uint32_t end;
+		bool released;
+	} leases[USART_RX_MAX_LEASES];
+	unsigned int lease_head;
+	unsigned int lease_count;
+	volatile unsigned int rx_buf_apos;
+
+	// Lease backing the single-chunk usart_receive_chunk() interface
+	usart_rx_lease_t chunk_lease;
+	bool chunk_held;
+} usart_port_t;
+
+static usart_port_t usart_ports[USART_NUM_PORTS] = {
+	[USART_PORT_1] = {
+		.huart = &huart1,
+		.instance = USART1,
+		.hdma = &hdma_usart1_rx,
+		.rts_gpio = GPIOA,
+		.rts_pin = GPIO_PIN_12,
+	},
+	[USART_PORT_2] = {
+		.huart = &huart2,
+		.instance = USART2,
+		.hdma = &hdma_usart2_rx,
+		.rts_gpio = GPIOA,
+		.rts_pin = GPIO_PIN_1,
+	},
+	[USART_PORT_6] = {
+		.huart = &huart6,
+		.instance = USART6,
+		.hdma = &hdma_usart6_rx,
+	},
+	[USART_PORT_SPI] = {
+		.hdma = &hdma_spi2_rx,
+	},
+};
 
 /**
-	* @brief USART1 Initialization Function
+	* @brief USART Initialization Function
+	* @param huart  UART handle to initialise
+	* @param instance  USART1, USART2 or USART6
 	* @param baud  波特率设置
 	* @retval None
 	*/
-void MX_USART1_UART_Init(uint32_t baud)
+void MX_USART_UART_Init(UART_HandleTypeDef *huart, USART_TypeDef *instance,
+		uint32_t baud)
 {
+	huart->Instance = instance;
+	huart->Init.BaudRate = baud;         //115200;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits = UART_STOPBITS_1;
+	huart->Init.Parity = UART_PARITY_NONE;
+	huart->Init.Mode = UART_MODE_TX_RX;
+	huart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+	huart->Init.OverSampling = UART_OVERSAMPLING_16;
+	if (HAL_UART_Init(huart) != HAL_OK)
+	{
+		led_panic("UART ");
+	}
+}
 
-	/* USER CODE BEGIN USART1_Init 0 */
+static inline unsigned int advance_pos(usart_port_t *p, unsigned int cur_pos,
+		unsigned int amt)
+{
+	return rx_ring_advance(cur_pos, amt, p->rx_buf_len);
+}
 
-	/* USER CODE END USART1_Init 0 */
+static inline unsigned int current_wpos(usart_port_t *p)
+{
+	if (p->rx_dma) {
+		return rx_ring_dma_wpos(p->rx_buf_len,
+				__HAL_DMA_GET_COUNTER(p->hdma));
+	}
 
-	/* USER CODE BEGIN USART1_Init 1 */
+	return p->rx_buf_wpos;
+}
 
-	/* USER CODE END USART1_Init 1 */
-	huart1.Instance = USART1;
-	huart1.Init.BaudRate = baud;         //115200;
-	huart1.Init.WordLength = UART_WORDLENGTH_8B;
-	huart1.Init.StopBits = UART_STOPBITS_1;
-	huart1.Init.Parity = UART_PARITY_NONE;
-	huart1.Init.Mode = UART_MODE_TX_RX;
-	huart1.Init.HwFlowCtl = UART_HWCONTROL_NONE;
-	huart1.Init.OverSampling = UART_OVERSAMPLING_16;
-	if (HAL_UART_Init(&huart1) != HAL_OK)
-	{
-		led_panic("UART ");
+// Stream index (count of bytes received before it) of the byte at ring
+// position pos, which mustn't be ahead of the writer.  Interrupts off.
+static uint32_t index_at(usart_port_t *p, unsigned int pos)
+{
+	unsigned int wpos = current_wpos(p);
+	uint32_t rx_index = p->rx_index +
+		rx_ring_used(p->rx_buf_wpos, wpos, p->rx_buf_len);
+
+	return rx_index - rx_ring_used(pos, wpos, p->rx_buf_len);
+}
+
+static inline void push_stamp(usart_port_t *p, uint32_t rx_index, uint32_t us)
+{
+	unsigned int i = p->stamp_head % USART_RX_STAMPS;
+
+	p->stamps[i].rx_index = rx_index;
+	p->stamps[i].us = us;
+	p->stamp_head++;
+}
+
+static void usart_rx_ISR(usart_port_t *p)
+{
+    	// Receive the character ASAP.
+
+	unsigned char c = (p->instance->DR & 0xFF);
+
+	if (!p->rx_seen) {
+		p->rx_first_us = timebase_us();
+		p->rx_seen = true;
 	}
-	/* USER CODE BEGIN USART1_Init 2 */
 
-	/* USER CODE END USART1_Init 2 */
+	if (p->rx_gap_stamps) {
+		uint32_t now = timebase_us();
+
+		if ((now - p->rx_last_us) > p->rx_gap_us) {
+			// End of the previous burst
+			push_stamp(p, p->rx_index, p->rx_last_us);
+		}
 
+		p->rx_last_us = now;
+	}
+
+	unsigned int wpos = p->rx_buf_wpos;
+	unsigned int next_wpos = advance_pos(p, wpos, 1);
+
+	if (next_wpos == p->rx_buf_rpos) {
+		if (!p->rx_drop_pending) {
+			p->rx_drop_pos = wpos;
+			p->rx_drop_pending = true;
+		}
+
+		p->rx_spilled++;
+		return;
+	}
+
+	p->rx_buf[wpos] = c;
+	p->rx_buf_wpos = next_wpos;
+	p->rx_index++;
+}
+
+// Called on DMA half-transfer, transfer-complete and USART IDLE.  The DMA
+// never stops, so the best we can do on overrun is to account for it: any
+// advance beyond the free space we had at the last event overwrote unread
+// data.  Events come at least every half buffer, so the advance is never
+// ambiguous.
+//
+// On overrun the ring is full, and the reader moves on to its oldest byte,
+// the one after the writer.  Bytes not yet handed out that were overwritten
+// are counted as spilled, with the drop point where the reader resumes.
+// Leases already handed out over the overwritten bytes can't be taken back:
+// their holder may write out the newer bytes in their place, which isn't
+// counted.  Releasing them later leaves the reader where the overrun put it.
+static void usart_rx_dma_ISR(usart_port_t *p)
+{
+	unsigned int wpos = p->rx_buf_wpos;
+	unsigned int next_wpos = current_wpos(p);
+
+	unsigned int advanced = next_wpos + p->rx_buf_len - wpos;
+	if (advanced >= p->rx_buf_len) {
+		advanced -= p->rx_buf_len;
+	}
+
+	unsigned int free = p->rx_buf_rpos + p->rx_buf_len - wpos - 1;
+	if (free >= p->rx_buf_len) {
+		free -= p->rx_buf_len;
+	}
+
+	bool lapped = advanced > free;
+
+	if (lapped) {
+		unsigned int rpos = p->rx_buf_rpos;
+		unsigned int apos = p->rx_buf_apos;
+		unsigned int lost = rx_ring_overrun(&rpos, &apos, advanced,
+				free, p->rx_buf_len);
+
+		p->rx_buf_rpos = rpos;
+
+		if (lost) {
+			p->rx_buf_apos = apos;
+			p->rx_drop_pos = apos;
+			p->rx_drop_pending = true;
+			p->rx_spilled += lost;
+		}
+	}
+
+	p->rx_buf_wpos = next_wpos;
+	p->rx_index += advanced;
+
+	if (lapped) {
+		// The ring before the reader no longer follows on
+		uint32_t floor = p->rx_index - (p->rx_buf_len - 1);
+
+		if ((int32_t) (floor - p->rx_rewind_floor) > 0) {
+			p->rx_rewind_floor = floor;
+		}
+	}
+
+	if (advanced) {
+		uint32_t now = timebase_us();
+
+		if (!p->rx_seen) {
+			p->rx_first_us = now;
+			p->rx_seen = true;
+		}
+
+		push_stamp(p, p->rx_index, now);
+	}
 }
 
-static inline unsigned int advance_pos(unsigned int cur_pos, unsigned int amt)
+// Called with a status register value that has FE, NE or ORE set.  Only
+// runs when an error is present, so it adds nothing per byte.  In RXNE mode
+// the following DR read clears the flags; in DMA mode the next DMA read of
+// DR does, so an error is counted at least once per event.
+static void usart_line_error_ISR(usart_port_t *p, uint32_t sr)
 {
-	cur_pos += amt;
-	if (cur_pos >= usart_rx_buf_len) {
-		cur_pos -= usart_rx_buf_len;
+	if (sr & USART_SR_FE) {
+		p->line_errors.fe++;
+	}
+
+	if (sr & USART_SR_NE) {
+		p->line_errors.ne++;
 	}
 
-	return cur_pos;
+	if (sr & USART_SR_ORE) {
+		p->line_errors.ore++;
+	}
 }
 
-void usart1_rx_ISR(void)
+void usart_IRQHandler(usart_port_e port)
 {
-    	// Receive the character ASAP.
-    
-	unsigned char c = (huart1.Instance->DR & 0xFF);
+	usart_port_t *p = &usart_ports[port];
+	UART_HandleTypeDef *huart = p->huart;
+
+	uint32_t sr = p->instance->SR;
+
+	if (sr & (USART_SR_FE | USART_SR_NE | USART_SR_ORE)) {
+		usart_line_error_ISR(p, sr);
+	}
+
+	if (__HAL_UART_GET_IT_SOURCE(huart, UART_IT_RXNE) &&
+			(sr & USART_SR_RXNE)) {
+		usart_rx_ISR(p);
+	}
+
+	// Only consult IDLE when DMA reception enabled it: clearing it reads
+	// DR, which would eat a byte in RXNE mode.
+	if (__HAL_UART_GET_IT_SOURCE(huart, UART_IT_IDLE) &&
+			(sr & USART_SR_IDLE)) {
+		__HAL_UART_CLEAR_IDLEFLAG(huart);
+		usart_rx_dma_ISR(p);
+	}
+}
+
+static void usart_rx_dma_event(DMA_HandleTypeDef *hdma)
+{
+	for (int i = 0; i < USART_NUM_PORTS; i++) {
+		usart_port_t *p = &usart_ports[i];
+
+		if (p->hdma != hdma) {
+			continue;
+		}
+
+		if (p->instance) {
+			uint32_t sr = p->instance->SR;
+
+			if (sr & (USART_SR_FE | USART_SR_NE | USART_SR_ORE)) {
+				usart_line_error_ISR(p, sr);
+			}
+		}
+
+		usart_rx_dma_ISR(p);
+	}
+}
+
+// For DMA sources other than a USART: account for a ring that the caller's
+// circular DMA (already configured on the port's hdma) fills.  Start the
+// DMA after this, and call usart_rx_event() at the end of each transfer as
+// the USART's IDLE would.
+void usart_rx_attach_dma(usart_port_e port, void *rx_buf,
+		uint32_t rx_buf_len)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	p->rx_buf = rx_buf;
+	p->rx_buf_len = rx_buf_len;
+	p->rx_dma = true;
+	p->enabled = true;
 
-	unsigned int wpos = usart_rx_buf_wpos;
-	unsigned int next_wpos = advance_pos(wpos, 1);
+	p->hdma->XferHalfCpltCallback = usart_rx_dma_event;
+	p->hdma->XferCpltCallback = usart_rx_dma_event;
+}
 
-	if (next_wpos == usart_rx_buf_rpos) {
-		usart_rx_spilled++;
+void usart_rx_event(usart_port_e port)
+{
+	usart_rx_dma_ISR(&usart_ports[port]);
+}
+
+static void usart_start_dma(usart_port_t *p)
+{
+	p->hdma->XferHalfCpltCallback = usart_rx_dma_event;
+	p->hdma->XferCpltCallback = usart_rx_dma_event;
+
+	if (HAL_DMA_Start_IT(p->hdma, (uint32_t) &p->instance->DR,
+				(uint32_t) p->rx_buf, p->rx_buf_len) != HAL_OK) {
+		led_panic("UDMA");
+	}
+
+	// Clear any stale IDLE before enabling it, then let the USART
+	// request DMA for every received byte.
+	__HAL_UART_CLEAR_IDLEFLAG(p->huart);
+	__HAL_UART_ENABLE_IT(p->huart, UART_IT_IDLE);
+	SET_BIT(p->instance->CR3, USART_CR3_DMAR);
+}
+
+static void usart_start(usart_port_t *p, uint32_t baud, bool use_dma)
+{
+    p->rx_dma = use_dma;
+    p->enabled = true;
+
+    // Two characters, 10 bits each
+    p->rx_gap_us = 20000000 / baud;
+
+    MX_USART_UART_Init(p->huart, p->instance, baud);
+
+    if (use_dma) {
+        usart_start_dma(p);
+    } else {
+        __HAL_UART_ENABLE_IT(p->huart, UART_IT_RXNE);
+    }
+}
+
+void uart_init(usart_port_e port, uint32_t baud, void *rx_buf,
+		uint32_t rx_buf_len, bool use_dma)
+{
+    usart_port_t *p = &usart_ports[port];
+
+    p->rx_buf = rx_buf;
+    p->rx_buf_len = rx_buf_len;
+    p->rx_rewind_floor = p->rx_index;
+
+    usart_start(p, baud, use_dma);
+}
+
+// Stop receiving, keeping what has been received for uart_restart() or
+// usart_rx_discard().  No leases may be held.
+void uart_stop(usart_port_e port)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	if (!p->enabled) {
 		return;
 	}
 
-	usart_rx_buf[wpos] = c;
-	usart_rx_buf_wpos = next_wpos;
+	if (p->lease_count) {
+		// .-.. . .- ... .
+		led_panic("LEASE");
+	}
+
+	__disable_irq();
+
+	if (p->rx_dma) {
+		CLEAR_BIT(p->instance->CR3, USART_CR3_DMAR);
+		__HAL_UART_DISABLE_IT(p->huart, UART_IT_IDLE);
+
+		// Account for what came in since the last DMA event
+		usart_rx_dma_ISR(p);
+	} else {
+		__HAL_UART_DISABLE_IT(p->huart, UART_IT_RXNE);
+	}
+
+	p->enabled = false;
+
+	__enable_irq();
+
+	if (p->rx_dma) {
+		HAL_DMA_Abort(p->hdma);
+	}
+}
+
+static void reverse(char *buf, unsigned int from, unsigned int to)
+{
+	while (from + 1 < to) {
+		char c = buf[from];
+
+		buf[from++] = buf[--to];
+		buf[to] = c;
+	}
+}
+
+// Carry on receiving a stopped port's stream into a new ring, which may
+// overlap the old one, at a new baud rate and mode if need be.  The unread
+// bytes move over, or the newest of them if they don't all fit (the rest
+// count as spilled); offsets, stamps and error counts carry on.
+void uart_restart(usart_port_e port, uint32_t baud, void *rx_buf,
+		uint32_t rx_buf_len, bool use_dma)
+{
+	usart_port_t *p = &usart_ports[port];
+	char *old = (char *) p->rx_buf;
+	unsigned int old_len = p->rx_buf_len;
+	unsigned int rpos = p->rx_buf_rpos;
+	unsigned int used = rx_ring_used(rpos, p->rx_buf_wpos, old_len);
+	unsigned int keep = MIN(used, rx_buf_len - 1);
+	unsigned int dropped = used - keep;
+	unsigned int drop_at = 0;
+
+	if (p->enabled) {
+		led_panic("UART ");
+	}
+
+	if (p->rx_drop_pending) {
+		unsigned int at = MIN(rx_ring_used(rpos, p->rx_drop_pos,
+					old_len), used);
+
+		drop_at = (at > dropped) ? at - dropped : 0;
+	}
+
+	if (dropped) {
+		p->rx_spilled += dropped;
+		p->rx_drop_pending = true;
+		drop_at = 0;
+	}
+
+	// Rotate the old ring in place (three reversals) so the unread
+	// bytes start at its beginning, then move them to the end of the new
+	// one: the DMA always starts filling at the beginning.
+	reverse(old, 0, rpos);
+	reverse(old, rpos, old_len);
+	reverse(old, 0, old_len);
+	memmove((char *) rx_buf + rx_buf_len - keep, old + dropped, keep);
+
+	p->rx_buf = rx_buf;
+	p->rx_buf_len = rx_buf_len;
+	p->rx_buf_wpos = 0;
+	p->rx_buf_rpos = advance_pos(p, rx_buf_len - keep, 0);
+	p->rx_buf_apos = p->rx_buf_rpos;
+	p->rx_drop_pos = advance_pos(p, p->rx_buf_rpos, drop_at);
+	p->rx_rewind_floor = p->rx_index - keep;
+
+	usart_start(p, baud, use_dma);
+}
+
+// Throw away a stopped port's unread bytes, e.g. ones received at the
+// wrong baud rate.  Returns how many there were.
+unsigned int usart_rx_discard(usart_port_e port)
+{
+	usart_port_t *p = &usart_ports[port];
+	unsigned int used = rx_ring_used(p->rx_buf_rpos, p->rx_buf_wpos,
+			p->rx_buf_len);
+
+	p->rx_buf_rpos = p->rx_buf_wpos;
+	p->rx_buf_apos = p->rx_buf_wpos;
+	p->rx_drop_pending = false;
+	p->rx_spilled_reported = p->rx_spilled;
+	p->rx_rewind_floor = p->rx_index;
+	p->rx_seen = false;
+
+	return used;
+}
+
+// Stop the USART taking in bytes, from any context, interrupts included.
+// The ring, leases and positions are left alone, so what was received can
+// still be read out.  There's no going back short of uart_init().
+void usart_rx_halt(usart_port_e port)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	if (p->instance) {
+		CLEAR_BIT(p->instance->CR1, USART_CR1_RE);
+	}
+}
+
+// Keep arrival stamps in RXNE mode too, for usart_rx_stamp().  DMA mode
+// stamps every event anyway; without this, RXNE mode stamps nothing and
+// every byte gets its lease's acquire time.
+void usart_rx_enable_stamps(usart_port_e port)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	p->rx_last_us = timebase_us();
+	p->rx_gap_stamps = true;
+}
+
+// When the port's first byte arrived, in timebase_us(); false if none has
+bool usart_rx_first_us(usart_port_e port, uint32_t *us)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	*us = p->rx_first_us;
+
+	return p->rx_seen;
+}
+
+// True if the port has an RTS pin for usart_enable_flow_control().  USART6
+// has none on this package, and the SPI slave port is clocked by the
+// master, so has nothing to hold off with.
+bool usart_has_rts(usart_port_e port)
+{
+	return usart_ports[port].rts_gpio != NULL;
+}
+
+// high_water and low_water are in unreleased bytes of the port's ring.
+// USART6 has no RTS pin on this package.  USART1's RTS (PA12) is USART6's
+// RX, so the two can't be used together.
+void usart_enable_flow_control(usart_port_e port, unsigned int high_water,
+		unsigned int low_water)
+{
+	usart_port_t *p = &usart_ports[port];
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	if ((!p->rts_gpio) || (low_water >= high_water) ||
+			(high_water >= p->rx_buf_len)) {
+		// ..-. .-.. --- .--
+		led_panic("FLOW");
+	}
+
+	p->rts_high_water = high_water;
+	p->rts_low_water = low_water;
+
+	// Ready to receive
+	HAL_GPIO_WritePin(p->rts_gpio, p->rts_pin, GPIO_PIN_RESET);
+
+	GPIO_InitStruct.Pin = p->rts_pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+	HAL_GPIO_Init(p->rts_gpio, &GPIO_InitStruct);
+
+	p->flow_control = true;
+}
+
+static void usart_flow_tick(usart_port_t *p)
+{
+	unsigned int used = rx_ring_used(p->rx_buf_rpos, current_wpos(p),
+			p->rx_buf_len);
+
+	if ((!p->rts_held) && (used > p->rts_high_water)) {
+		HAL_GPIO_WritePin(p->rts_gpio, p->rts_pin, GPIO_PIN_SET);
+
+		p->rts_held = true;
+		p->rts_held_since = HAL_GetTick();
+		p->flow_stats.holdoffs++;
+	} else if (p->rts_held && (used <= p->rts_low_water)) {
+		HAL_GPIO_WritePin(p->rts_gpio, p->rts_pin, GPIO_PIN_RESET);
+
+		p->rts_held = false;
+		p->flow_stats.held_ms += HAL_GetTick() - p->rts_held_since;
+	}
+}
+
+// Called from SysTick.  At 1ms the sender can get at most a millisecond of
+// data past the high water mark before seeing RTS, plus whatever its own
+// FIFO holds; size the headroom accordingly.
+void usart_tick(void)
+{
+	for (int i = 0; i < USART_NUM_PORTS; i++) {
+		if (usart_ports[i].flow_control) {
+			usart_flow_tick(&usart_ports[i]);
+		}
+	}
+}
+
+// held_ms includes a holdoff still in progress.
+void usart_get_flow_stats(usart_port_e port, usart_flow_stats_t *stats)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	__disable_irq();
+	stats->holdoffs = p->flow_stats.holdoffs;
+	stats->held_ms = p->flow_stats.held_ms;
+	if (p->rts_held) {
+		stats->held_ms += HAL_GetTick() - p->rts_held_since;
+	}
+	__enable_irq();
 }
 
-void uart_init(uint32_t baud, void *rx_buf, uint32_t rx_buf_len)
+static void set_lease_iov(usart_port_t *p, usart_rx_lease_t *lease,
+		unsigned int pos)
 {
-    usart_rx_buf = rx_buf;
-    usart_rx_buf_len = rx_buf_len;
+	lease->iovcnt = rx_ring_split(pos, lease->len, p->rx_buf_len,
+			&lease->iov[0].len, &lease->iov[1].len);
 
-    MX_USART1_UART_Init(baud);
+	lease->iov[0].base = (const char *) (p->rx_buf + pos);
+	lease->iov[1].base = (const char *) p->rx_buf;
+}
+
+// Bytes available to the next acquire.  Sets *stop when they run up to a
+// spill gap, past which nothing may be handed out, so waiting is pointless.
+static unsigned int pending_bytes(usart_port_t *p, bool *stop)
+{
+	unsigned int apos = p->rx_buf_apos;
+	unsigned int bytes = rx_ring_used(apos, current_wpos(p),
+			p->rx_buf_len);
+
+	*stop = false;
+
+	if (p->rx_drop_pending) {
+		unsigned int to_drop = rx_ring_used(apos, p->rx_drop_pos,
+				p->rx_buf_len);
+
+		if (to_drop <= bytes) {
+			bytes = to_drop;
+			*stop = true;
+		}
+	}
+
+	return bytes;
+}
+
+// True if an acquire with this min_preferred_chunk would return without
+// waiting.  Lets a caller servicing several ports poll them in turn.
+bool usart_rx_ready(usart_port_e port, unsigned int min_preferred_chunk)
+{
+	usart_port_t *p = &usart_ports[port];
+	bool stop;
+
+	if (!p->enabled) {
+		return false;
+	}
+
+	return (pending_bytes(p, &stop) >= min_preferred_chunk) || stop;
+}
+
+// Bytes received and not yet released, whether leased or not.
+unsigned int usart_rx_used(usart_port_e port)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	return rx_ring_used(p->rx_buf_rpos, current_wpos(p), p->rx_buf_len);
 }
 
 // Logic for return here is as follows:
 // 1) Always return in timeout time
 // 1a) can return early if the amount exceeds min_preferred_chunk
-// 1b) can also return early if we are at the end of the buffer
 // 2) If, after timeout, we have at least some we can return that keeps us
 // aligned with preferred_align, return it
 // 3) else, return everything we have
-// It's expected the buffer is a multiple of preferred_align.
+// It's expected the buffer is a multiple of preferred_align, so alignment
+// carries across the end of the ring; a chunk that wraps comes back as two
+// segments rather than being cut short at the end of the buffer.
 // min_preferred_chunk should be >= 2x preferred_align; that way, if we
 // are unaligned we can get a complete aligned chunk plus the offset
-const char *usart_receive_chunk(unsigned int timeout,
+//
+// The lease starts where the previous one ended, so several can be held at
+// once without overlapping.  Returns false without waiting if every lease
+// slot is in use; release one first.
+bool usart_rx_acquire(usart_port_e port, unsigned int timeout,
 		unsigned int preferred_align,
 		unsigned int min_preferred_chunk,
 		unsigned int max_preferred_chunk,
-		unsigned int *bytes_returned)
+		usart_rx_lease_t *lease)
 {
-	unsigned int expiration = HAL_GetTick() + timeout;
+	usart_port_t *p = &usart_ports[port];
 
-	// Release the previously read chunk, so receiving can proceed into it
-	unsigned int rpos = usart_rx_buf_next_rpos;
-	usart_rx_buf_rpos = rpos;
+	if (p->lease_count >= USART_RX_MAX_LEASES) {
+		return false;
+	}
+
+	uint32_t start = HAL_GetTick();
 
 	unsigned int bytes;
+	bool stop;
+
+	// Wait for a completion condition.  Anything that can change it is an
+	// interrupt: DMA half/complete, IDLE or RXNE, and the 1ms SysTick,
+	// which covers the deadline and the NDTR creeping between DMA events.
+	// So sleep until the next one instead of spinning against the ISRs
+	// for the bus.  Unsigned differences keep the deadline wrap safe.
+	for (;;) {
+		bytes = pending_bytes(p, &stop);
+
+		if (stop) break;
+
+		if (bytes >= min_preferred_chunk) break;
+
+		if ((HAL_GetTick() - start) >= timeout) break;
+
+		__WFI();
+	}
+
+	// Past a gap the ring position no longer maps onto the stream
+	lease->stamp_ahead = 0;
+
+	// Look again with interrupts off: an overrun may have moved apos on
+	// while we waited
+	__disable_irq();
+	unsigned int apos = p->rx_buf_apos;
+	bytes = pending_bytes(p, &stop);
+	unsigned int wpos = current_wpos(p);
+	uint32_t now = timebase_us();
+	uint32_t rx_index = p->rx_index +
+		rx_ring_used(p->rx_buf_wpos, wpos, p->rx_buf_len);
+
+	unsigned int ahead = rx_ring_used(apos, wpos, p->rx_buf_len);
+
+	lease->rx_index = rx_index - ahead;
+	lease->stamp_us = now;
+
+	if (!stop) {
+		lease->stamp_ahead = ahead;
+	}
+
+	bytes = rx_ring_align_chunk(bytes, apos, preferred_align,
+			max_preferred_chunk);
+
+	unsigned int slot = (p->lease_head + p->lease_count) %
+		USART_RX_MAX_LEASES;
 
-	unsigned int unalign = rpos % preferred_align;
+	p->leases[slot].pos = apos;
+	p->leases[slot].len = bytes;
+	p->leases[slot].end = lease->rx_index + bytes;
+	p->leases[slot].released = false;
+	p->lease_count++;
 
-	// Busywait for a completion condition
-	do {
-		unsigned int wpos = usart_rx_buf_wpos;
+	p->rx_buf_apos = advance_pos(p, apos, bytes);
+	__enable_irq();
 
-		if (wpos < rpos) {
-			bytes = usart_rx_buf_len - rpos;
-			break;  // case 1b
+	lease->len = bytes;
+	lease->slot = slot;
+	lease->port = port;
+	set_lease_iov(p, lease, apos);
+
+	return true;
+}
+
+// When the byte at 'off' in the lease had arrived by: the first stamp taken
+// after it, so within one interrupt (or one RXNE burst) of the truth.
+// Bytes received since the last interrupt get the acquire time.
+uint32_t usart_rx_stamp(const usart_rx_lease_t *lease, unsigned int off)
+{
+	usart_port_t *p = &usart_ports[lease->port];
+	uint32_t rx_index = lease->rx_index + off;
+	uint32_t us = lease->stamp_us;
+
+	__disable_irq();
+
+	unsigned int head = p->stamp_head;
+	unsigned int n = MIN(head, USART_RX_STAMPS);
+
+	// Newest to oldest, remembering the oldest that's still after it
+	for (unsigned int i = 1; i <= n; i++) {
+		unsigned int s = (head - i) % USART_RX_STAMPS;
+
+		if ((int32_t) (p->stamps[s].rx_index - rx_index) <= 0) {
+			break;
+		}
+
+		if ((int32_t) (p->stamps[s].us - lease->stamp_us) <= 0) {
+			us = p->stamps[s].us;
 		}
+	}
 
-		bytes = wpos - rpos;
+	__enable_irq();
 
-		if (bytes >= min_preferred_chunk) break;
-	} while (HAL_GetTick() < expiration);
+	return us;
+}
+
+// True if the lease is one of the port's outstanding, unreleased leases.
+// A released lease has an out of range slot (see usart_rx_release()), so
+// releasing or committing it again can't touch a newer lease in its slot.
+static bool lease_held(usart_port_t *p, const usart_rx_lease_t *lease)
+{
+	unsigned int age = (lease->slot + USART_RX_MAX_LEASES -
+			p->lease_head) % USART_RX_MAX_LEASES;
+
+	return (lease->slot < USART_RX_MAX_LEASES) &&
+		(age < p->lease_count) && !p->leases[lease->slot].released;
+}
+
+// Keep only the first 'used' bytes of the most recently acquired lease; the
+// rest will be handed out again by the next acquire.
+void usart_rx_commit(usart_rx_lease_t *lease, unsigned int used)
+{
+	usart_port_t *p = &usart_ports[lease->port];
+
+	unsigned int newest = (p->lease_head + p->lease_count - 1) %
+		USART_RX_MAX_LEASES;
 
-	if (bytes > max_preferred_chunk) {
-		bytes = max_preferred_chunk;
+	if ((!lease_held(p, lease)) || (lease->slot != newest) ||
+			(used > lease->len)) {
+		// .-.. . .- ... .
+		led_panic("LEASE");
 	}
 
-	if ((bytes + unalign) >= preferred_align) {
-		// Fixup for align
-		bytes += unalign;
+	__disable_irq();
 
-		// Get integral number of align-sized chunks
-		bytes /= preferred_align;
-		bytes *= preferred_align;
+	// Unless an overrun has moved apos past the lease meanwhile
+	if (index_at(p, p->rx_buf_apos) == p->leases[newest].end) {
+		p->rx_buf_apos = advance_pos(p, p->leases[newest].pos, used);
+	}
+
+	p->leases[newest].len = used;
+	p->leases[newest].end -= lease->len - used;
+
+	__enable_irq();
+
+	lease->len = used;
+	set_lease_iov(p, lease, p->leases[newest].pos);
+}
 
-		// Unfixup for align
-		bytes -= unalign;
+// Leases may be released in any order, each once.  Receiving can proceed
+// into a lease's bytes once it and every lease older than it have been
+// released.
+void usart_rx_release(usart_rx_lease_t *lease)
+{
+	usart_port_t *p = &usart_ports[lease->port];
+
+	if (!lease_held(p, lease)) {
+		// .-.. . .- ... .
+		led_panic("LEASE");
 	}
 
-	*bytes_returned = bytes;
+	p->leases[lease->slot].released = true;
+
+	__disable_irq();
+
+	uint32_t rpos_index = index_at(p, p->rx_buf_rpos);
+
+	while (p->lease_count && p->leases[p->lease_head].released) {
+		unsigned int head = p->lease_head;
+
+		// An overrun may already have moved the reader past it
+		if ((int32_t) (p->leases[head].end - rpos_index) > 0) {
+			p->rx_buf_rpos = advance_pos(p, p->leases[head].pos,
+					p->leases[head].len);
+			rpos_index = p->leases[head].end;
+		}
+
+		p->lease_head = (head + 1) % USART_RX_MAX_LEASES;
+		p->lease_count--;
+	}
+
+	__enable_irq();
+
+	lease->len = 0;
+	lease->iovcnt = 0;
+	lease->slot = USART_RX_MAX_LEASES;
+}
+
+// Hand out again up to 'bytes' already released bytes, newest first, that
+// reception hasn't reused yet, leaving it at least 'guard' bytes of room.
+// Only with no lease held.  Returns how many bytes were taken back; the
+// next acquire starts with them.  Past what's taken back, reception now
+// has less room, and overruns it (as counted spills) as it would a reader
+// falling that far behind.
+unsigned int usart_rx_rewind(usart_port_e port, unsigned int bytes,
+		unsigned int guard)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	if ((!p->enabled) || p->lease_count || p->rx_drop_pending) {
+		return 0;
+	}
+
+	__disable_irq();
+
+	unsigned int rpos = p->rx_buf_rpos;
+	unsigned int used = rx_ring_used(rpos, current_wpos(p), p->rx_buf_len);
+
+	// One byte always stays free: a full ring would look empty
+	unsigned int room = p->rx_buf_len - 1 - used;
+	uint32_t behind = index_at(p, rpos) - p->rx_rewind_floor;
+
+	room = (room > guard) ? room - guard : 0;
+	bytes = MIN(bytes, room);
+	bytes = MIN(bytes, behind);
+
+	rpos = rx_ring_advance(rpos, p->rx_buf_len - bytes, p->rx_buf_len);
+	p->rx_buf_rpos = rpos;
+	p->rx_buf_apos = rpos;
+
+	__enable_irq();
+
+	return bytes;
+}
+
+// If every byte before a run of spills has been acquired, report how many
+// bytes went missing at this point of the stream and clear the condition.
+bool usart_rx_take_drop(usart_port_e port, unsigned int *dropped)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	__disable_irq();
+
+	if ((!p->rx_drop_pending) || (p->rx_drop_pos != p->rx_buf_apos)) {
+		__enable_irq();
+		return false;
+	}
+
+	unsigned int spilled = p->rx_spilled;
+	p->rx_drop_pending = false;
+	__enable_irq();
+
+	*dropped = spilled - p->rx_spilled_reported;
+	p->rx_spilled_reported = spilled;
+
+	__disable_irq();
+	p->rx_rewind_floor = index_at(p, p->rx_buf_apos);
+	__enable_irq();
+
+	return true;
+}
+
+void usart_get_line_errors(usart_port_e port, usart_line_errors_t *errs)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	errs->fe = p->line_errors.fe;
+	errs->ne = p->line_errors.ne;
+	errs->ore = p->line_errors.ore;
+}
+
+const char *usart_receive_chunk(usart_port_e port, unsigned int timeout,
+		unsigned int preferred_align,
+		unsigned int min_preferred_chunk,
+		unsigned int max_preferred_chunk,
+		unsigned int *bytes_returned)
+{
+	usart_port_t *p = &usart_ports[port];
+
+	// Release the previously read chunk, so receiving can proceed into it
+	if (p->chunk_held) {
+		usart_rx_release(&p->chunk_lease);
+		p->chunk_held = false;
+	}
+
+	if (!usart_rx_acquire(port, timeout, preferred_align,
+				min_preferred_chunk, max_preferred_chunk,
+				&p->chunk_lease)) {
+		// Caller is mixing this with explicit leases and holds them all
+		led_panic("LEASE");
+	}
+
+	p->chunk_held = true;
+
+	// Old behaviour: stop at the end of the buffer.
+	if (p->chunk_lease.iovcnt > 1) {
+		usart_rx_commit(&p->chunk_lease, p->chunk_lease.iov[0].len);
+	}
 
-	// Next time, we'll release these returned bytes.
-	usart_rx_buf_next_rpos = advance_pos(rpos, bytes);
+	*bytes_returned = p->chunk_lease.len;
 
-	return (const char *) (usart_rx_buf + rpos);
+	return p->chunk_lease.iov[0].base;
 }
@@ -37,14 +37,46 @@
 #include <string.h>
 #include "ff_gen_drv.h"
 #include "bsp_spi_flash.h"
+#include "bf_flash.h"
+#include "stats.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+#define SPI_FLASH_PAGE_SIZE                    256
 
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
 
+uint32_t USER_erase_count;
+uint32_t USER_write_erase_count;
+
+/* Sectors erased ahead of time by CTRL_TRIM, which USER_write() can program
+   without erasing again */
+static uint8_t erased[SPI_FLASH_SECTOR_NUM / 8];
+
+static int is_erased(DWORD sector)
+{
+    return (sector < SPI_FLASH_SECTOR_NUM) && (erased[sector / 8] & (1 << (sector % 8)));
+}
+
+static void set_erased(DWORD sector, int value)
+{
+    if (sector >= SPI_FLASH_SECTOR_NUM)
+    {
+        return;
+    }
+
+    if (value)
+    {
+        erased[sector / 8] |= 1 << (sector % 8);
+    }
+    else
+    {
+        erased[sector / 8] &= ~(1 << (sector % 8));
+    }
+}
+
 /* USER CODE END DECL */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -88,8 +120,14 @@ DSTATUS USER_initialize (
         return RES_PARERR;
     }
     
-    //MX_SPI1_Init(); 上电就会初始化，此处不做动作
-    Stat = RES_OK;
+    if (Stat & STA_NOINIT)
+    {
+        //探测Flash并初始化SPI1及其DMA
+        if (flashInit())
+        {
+            Stat &= ~STA_NOINIT;
+        }
+    }
     
     return Stat;
   /* USER CODE END INIT */
@@ -110,7 +148,6 @@ DSTATUS USER_status (
         return RES_PARERR;
     }
     
-    Stat = RES_OK;
     return Stat;
   /* USER CODE END STATUS */
 }
@@ -137,10 +174,18 @@ DRESULT USER_read (
         return RES_PARERR;
     }
     
-    // if (SPI_FLASH_ReadData(buff, sector * SPI_FLASH_SECTOR_SIZE, count * SPI_FLASH_SECTOR_SIZE))
-    // {
-    //     return RES_ERROR;
-    // }
+    if (Stat & STA_NOINIT)
+    {
+        return RES_NOTRDY;
+    }
+
+    for (; count > 0; count--, sector++, buff += SPI_FLASH_SECTOR_SIZE)
+    {
+        if (flashReadBytes(sector * SPI_FLASH_SECTOR_SIZE, buff, SPI_FLASH_SECTOR_SIZE) != SPI_FLASH_SECTOR_SIZE)
+        {
+            return RES_ERROR;
+        }
+    }
     return RES_OK;
   /* USER CODE END READ */
 }
@@ -168,10 +213,56 @@ DRESULT USER_write (
         return RES_PARERR;
     }
     
-    // if(SPI_FLASH_WriteData(buff, sector * SPI_FLASH_SECTOR_SIZE, count * SPI_FLASH_SECTOR_SIZE))
-    // {
-    //     return RES_ERROR;
-    // }
+    if (Stat & STA_NOINIT)
+    {
+        return RES_NOTRDY;
+    }
+
+    for (; count > 0; count--, sector++)
+    {
+        uint32_t addr = sector * SPI_FLASH_SECTOR_SIZE;
+
+        if (is_erased(sector))
+        {
+            set_erased(sector, 0);
+        }
+        else
+        {
+            //第一页编程本来也要等擦除完成，这里等待以便计时
+            uint32_t start = stats_start();
+
+            flashEraseSubsector(addr);
+            bool erased = flashWaitForReady();
+            stats_end(STATS_ERASE, start);
+            USER_erase_count++;
+            USER_write_erase_count++;
+
+            if (!erased)
+            {
+                return RES_ERROR;
+            }
+        }
+
+        //页编程由DMA完成，返回时最后一页可能仍在发送/编程，
+        //下一次访问Flash前驱动会自动等待
+        //A page not sent means the previous one never finished; the
+        //last page's own timeout shows at the next write or CTRL_SYNC
+        for (int i = 0; i < SPI_FLASH_SECTOR_SIZE / SPI_FLASH_PAGE_SIZE; i++)
+        {
+            uint32_t start = stats_start();
+
+            bool sent = flashPageProgram(addr, buff, SPI_FLASH_PAGE_SIZE);
+            stats_end(STATS_PROGRAM, start);
+
+            if (!sent)
+            {
+                return RES_ERROR;
+            }
+
+            addr += SPI_FLASH_PAGE_SIZE;
+            buff += SPI_FLASH_PAGE_SIZE;
+        }
+    }
     return RES_OK;
   /* USER CODE END WRITE */
 }
@@ -202,7 +293,8 @@ DRESULT USER_ioctl (
     switch(cmd)
     {
     case CTRL_SYNC:
-        res = RES_OK;
+        //等待最后一页DMA发送及编程完成
+        res = flashWaitForReady() ? RES_OK : RES_ERROR;
         break;
 
     case GET_SECTOR_COUNT:
@@ -215,6 +307,20 @@ DRESULT USER_ioctl (
         res = RES_OK;
         break;
 
+    case CTRL_TRIM:
+        //擦除不再使用的扇区，之后写入时无需再擦除
+        for (DWORD sector = ((DWORD*)buff)[0]; sector <= ((DWORD*)buff)[1]; sector++)
+        {
+            if (!is_erased(sector))
+            {
+                flashEraseSubsector(sector * SPI_FLASH_SECTOR_SIZE);
+                USER_erase_count++;
+                set_erased(sector, 1);
+            }
+        }
+        res = RES_OK;
+        break;
+
     case GET_BLOCK_SIZE:
         *(DWORD*)buff = 1;
         res = RES_OK;
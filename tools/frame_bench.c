@@ -0,0 +1,106 @@
+// Host benchmark for the logger's frame synchroniser (Src/frame_sync.c).
+//
+// Build: cc -O2 -I../Inc -o frame_bench frame_bench.c ../Src/frame_sync.c
+//
+// Usage: frame_bench PROTO FILE [PIECE [REPEAT]]
+//
+// Feeds a recorded stream (e.g. a log written without frameDrop) through
+// the synchroniser in PIECE byte pieces (default 40960, the logger's
+// largest chunk), REPEAT times (default 20), with frameDrop on.  Prints the
+// frame counts for one pass and the throughput.  2 Mbaud is 200 KB/s, a
+// budget of 480 cycles a byte at 96 MHz; multiply ns/byte by the host's
+// GHz for its cycles a byte (the Cortex-M4 takes a few times more).
+
+#include "frame_sync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long long emitted;
+
+static void count_emit(void *ctx, const uint8_t *buf, unsigned int len)
+{
+	emitted += len;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s mavlink|crsf|blackbox file "
+				"[piece [repeat]]\n", argv[0]);
+		return 1;
+	}
+
+	const frame_proto_t *proto = frame_sync_find_proto(argv[1],
+			strlen(argv[1]));
+
+	if (!proto) {
+		fprintf(stderr, "unknown protocol %s\n", argv[1]);
+		return 1;
+	}
+
+	unsigned int piece = (argc > 3) ? strtoul(argv[3], NULL, 0) : 40960;
+	unsigned int repeat = (argc > 4) ? strtoul(argv[4], NULL, 0) : 20;
+
+	FILE *f = fopen(argv[2], "rb");
+
+	if (!f) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *data = malloc(size);
+
+	if ((!data) || (fread(data, 1, size, f) != (size_t) size)) {
+		fprintf(stderr, "%s: read failed\n", argv[2]);
+		return 1;
+	}
+
+	fclose(f);
+
+	static frame_sync_t fs;
+	frame_sync_stats_t first = { 0 };
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (unsigned int r = 0; r < repeat; r++) {
+		frame_sync_init(&fs, proto, count_emit, NULL);
+
+		for (long i = 0; i < size; i += piece) {
+			unsigned int n = piece;
+
+			if (n > size - i) {
+				n = size - i;
+			}
+
+			frame_sync_feed(&fs, data + i, n);
+		}
+
+		frame_sync_flush(&fs);
+
+		if (!r) {
+			first = fs.stats;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double bytes = (double) size * repeat;
+
+	printf("%s: %ld bytes, good %u bad %u unchecked %u garbage %u, "
+			"kept %llu\n", proto->name, size,
+			first.good, first.bad, first.unchecked, first.garbage,
+			emitted / repeat);
+	printf("%.1f MB/s, %.2f ns/byte\n", bytes / secs / 1e6,
+			secs * 1e9 / bytes);
+
+	free(data);
+	return 0;
+}
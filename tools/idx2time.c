@@ -0,0 +1,160 @@
+// Host decoder for the logger's time index sidecar (logNNN.idx).
+//
+// Build: cc -O2 -o idx2time idx2time.c
+//
+// Usage:
+//   idx2time log000.idx                  dump every entry
+//   idx2time log000.idx PORT OFFSET...   time of each byte offset
+//
+// PORT is the USART number (1, 2 or 6; 0 for the SPI slave).  OFFSET
+// counts bytes of that port's source stream: dropped bytes included,
+// in-band markers and interleaved record headers not.  Times are seconds since the logger's
+// timebase started; the 32 bit microsecond counter is unwrapped here,
+// which assumes entries are less than ~71 minutes apart.
+//
+// Each entry says every byte before 'offset' had arrived by 'us', so a
+// byte's time is interpolated between the entries either side of it.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IDX_MAGIC "LIDX"
+#define IDX_VERSION 1
+
+typedef struct idx_entry_s {
+	uint8_t port;
+	uint8_t reserved[3];
+	uint32_t offset;
+	uint32_t us;
+} idx_entry_t;
+
+typedef struct entry_s {
+	unsigned int port;
+	uint64_t offset;
+	uint64_t us;
+} entry_t;
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static entry_t *load(const char *name, size_t *count)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t hdr[8];
+
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+
+	if ((fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) ||
+			memcmp(hdr, IDX_MAGIC, 4) || (hdr[4] != IDX_VERSION) ||
+			(hdr[5] < sizeof(idx_entry_t))) {
+		fprintf(stderr, "%s: not a version %d index\n", name,
+				IDX_VERSION);
+		exit(1);
+	}
+
+	size_t entry_size = hdr[5];
+	size_t n = 0, cap = 1024;
+	entry_t *e = malloc(cap * sizeof(*e));
+	uint8_t raw[256];
+	uint32_t last_us = 0;
+	uint64_t wraps = 0;
+
+	// Per port, offsets only grow; the port field keeps them apart.
+	while (fread(raw, 1, entry_size, f) == entry_size) {
+		uint32_t us = get_le32(raw + 8);
+
+		if (n && (us < last_us)) {
+			wraps++;
+		}
+		last_us = us;
+
+		if (n == cap) {
+			cap *= 2;
+			e = realloc(e, cap * sizeof(*e));
+		}
+
+		e[n].port = raw[0];
+		e[n].offset = get_le32(raw + 4);
+		e[n].us = (wraps << 32) | us;
+		n++;
+	}
+
+	fclose(f);
+
+	*count = n;
+	return e;
+}
+
+static void lookup(const entry_t *e, size_t n, unsigned int port,
+		uint64_t offset)
+{
+	const entry_t *prev = NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		if (e[i].port != port) {
+			continue;
+		}
+
+		if (e[i].offset < offset) {
+			prev = &e[i];
+			continue;
+		}
+
+		if (!prev) {
+			// Arrived at or before the first stamp
+			printf("%" PRIu64 " <=%.6f\n", offset, e[i].us / 1e6);
+			return;
+		}
+
+		double frac = (double) (offset - prev->offset) /
+			(e[i].offset - prev->offset);
+		double us = prev->us + frac * (e[i].us - prev->us);
+
+		printf("%" PRIu64 " %.6f\n", offset, us / 1e6);
+		return;
+	}
+
+	if (prev) {
+		printf("%" PRIu64 " >%.6f\n", offset, prev->us / 1e6);
+	} else {
+		printf("%" PRIu64 " ?\n", offset);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s file.idx [port offset...]\n",
+				argv[0]);
+		return 1;
+	}
+
+	entry_t *e = load(argv[1], &n);
+
+	if (argc == 2) {
+		for (size_t i = 0; i < n; i++) {
+			printf("%u %" PRIu64 " %.6f\n", e[i].port, e[i].offset,
+					e[i].us / 1e6);
+		}
+		return 0;
+	}
+
+	unsigned int port = strtoul(argv[2], NULL, 0);
+
+	for (int i = 3; i < argc; i++) {
+		lookup(e, n, port, strtoull(argv[i], NULL, 0));
+	}
+
+	free(e);
+	return 0;
+}
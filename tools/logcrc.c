@@ -0,0 +1,283 @@
+// Host checker and extractor for the logger's CRC checked record container
+// ("crcRecords" : true, see Inc/log_record.h).
+//
+// Build: cc -O2 -I../Inc -o logcrc logcrc.c
+//
+// Usage:
+//   logcrc LOG [PORT] > payload   check, and extract the good records
+//   logcrc -c LOG                 check only
+//
+// PORT is the USART number (1, 2 or 6; 0 for the SPI slave); without it,
+// every port's records are extracted in file order.  Records of
+// compressed logs hold lz blocks: save the output and run unlz on it.
+//
+// The log is read in one pass, so this checks at about the speed of the
+// disk it's on.  Damage is reported on stderr as the byte ranges that
+// don't parse as good records, and, from the sequence numbers either side,
+// which records of each port were lost in them.  A range of nothing but
+// erased (0xff) or zero bytes running to the end of the log is reported
+// as unwritten rather than damaged: a log cut off by a power cut, before
+// recovery, ends like that.  Exits 2 if there was any damage.
+
+#include "log_record.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_LEN (8 << 20)
+
+// Far past anything the logger's ring could hold; a longer length is
+// damage
+#define LEN_MAX (1 << 20)
+
+#define CRC_POLY 0x04C11DB7
+
+static uint32_t crc_table[4][256];
+
+static void crc_init(void)
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		uint32_t c = i << 24;
+
+		for (int b = 0; b < 8; b++) {
+			c = (c & 0x80000000) ? (c << 1) ^ CRC_POLY : c << 1;
+		}
+
+		crc_table[0][i] = c;
+	}
+
+	// crc_table[n][x]: x shifted through 8 * n more zero bits
+	for (int n = 1; n < 4; n++) {
+		for (unsigned int i = 0; i < 256; i++) {
+			uint32_t c = crc_table[n - 1][i];
+
+			crc_table[n][i] = (c << 8) ^ crc_table[0][c >> 24];
+		}
+	}
+}
+
+static inline uint32_t crc_word(uint32_t crc, uint32_t w)
+{
+	crc ^= w;
+
+	return crc_table[3][crc >> 24] ^ crc_table[2][(crc >> 16) & 0xff] ^
+		crc_table[1][(crc >> 8) & 0xff] ^ crc_table[0][crc & 0xff];
+}
+
+// As the STM32 CRC unit fed little endian words, the last zero padded
+static uint32_t crc_bytes(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len >= 4; p += 4, len -= 4) {
+		crc = crc_word(crc, p[0] | (p[1] << 8) | (p[2] << 16) |
+				((uint32_t) p[3] << 24));
+	}
+
+	if (len) {
+		uint32_t w = 0;
+
+		for (size_t i = 0; i < len; i++) {
+			w |= (uint32_t) p[i] << (8 * i);
+		}
+
+		crc = crc_word(crc, w);
+	}
+
+	return crc;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+typedef struct stream_s {
+	FILE *f;
+	uint8_t *buf;
+	size_t fill;
+	size_t pos;
+	unsigned long long base;	// file offset of buf[0]
+	bool eof;
+} stream_t;
+
+// Bytes available at pos, reading ahead for at least want of them
+static size_t stream_ensure(stream_t *s, size_t want)
+{
+	if ((s->fill - s->pos < want) && !s->eof) {
+		memmove(s->buf, s->buf + s->pos, s->fill - s->pos);
+		s->base += s->pos;
+		s->fill -= s->pos;
+		s->pos = 0;
+
+		while ((s->fill < BUF_LEN) && !s->eof) {
+			size_t n = fread(s->buf + s->fill, 1, BUF_LEN - s->fill,
+					s->f);
+
+			if (!n) {
+				s->eof = true;
+			}
+			s->fill += n;
+		}
+	}
+
+	return s->fill - s->pos;
+}
+
+// Length of the good record at p, header included; 0 if there isn't one
+static size_t check_record(const uint8_t *p, size_t avail,
+		log_record_hdr_t *hdr)
+{
+	if ((avail < sizeof(*hdr)) || (p[0] != LOG_RECORD_MAGIC0) ||
+			(p[1] != LOG_RECORD_MAGIC1)) {
+		return 0;
+	}
+
+	hdr->port = p[2];
+	hdr->flags = p[3];
+	hdr->seq = get32(p + 4);
+	hdr->us = get32(p + 8);
+	hdr->len = get32(p + 12);
+	hdr->crc = get32(p + 16);
+
+	if ((hdr->len > LEN_MAX) || (avail - sizeof(*hdr) < hdr->len)) {
+		return 0;
+	}
+
+	uint32_t crc = crc_bytes(0xffffffff, p, LOG_RECORD_CRC_HDR_LEN);
+
+	crc = crc_bytes(crc, p + sizeof(*hdr), hdr->len);
+
+	return (crc == hdr->crc) ? sizeof(*hdr) + hdr->len : 0;
+}
+
+typedef struct port_seq_s {
+	bool seen;
+	uint32_t next;
+} port_seq_t;
+
+int main(int argc, char **argv)
+{
+	static port_seq_t ports[256];
+	bool check_only = (argc > 1) && !strcmp(argv[1], "-c");
+	int arg = check_only ? 2 : 1;
+
+	if ((argc <= arg) || (argv[arg][0] == '-')) {
+		fprintf(stderr, "usage: %s log [port] > payload\n"
+				"       %s -c log\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	const char *name = argv[arg];
+	int port = (argc > arg + 1) ? atoi(argv[arg + 1]) : -1;
+	stream_t s = { .f = fopen(name, "rb"), .buf = malloc(BUF_LEN) };
+
+	if (!s.f) {
+		perror(name);
+		return 1;
+	}
+
+	crc_init();
+
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	unsigned long long records = 0, payload = 0, missing = 0;
+	unsigned long long damaged = 0, damaged_bytes = 0;
+	unsigned long long bad_start = 0;
+	bool bad = false, blank = true;
+
+	for (;;) {
+		size_t avail = stream_ensure(&s, sizeof(log_record_hdr_t) +
+				LEN_MAX);
+		const uint8_t *p = s.buf + s.pos;
+		unsigned long long off = s.base + s.pos;
+		log_record_hdr_t hdr;
+		size_t n;
+
+		if (!avail) {
+			break;
+		}
+
+		n = check_record(p, avail, &hdr);
+
+		if (!n) {
+			// Skip to the next possible record start
+			const uint8_t *next = memchr(p + 1, LOG_RECORD_MAGIC0,
+					avail - 1);
+			size_t skip = next ? (size_t) (next - p) : avail;
+
+			if (!bad) {
+				bad = true;
+				blank = true;
+				bad_start = off;
+			}
+
+			for (size_t i = 0; blank && (i < skip); i++) {
+				blank = (p[i] == 0xff) || (p[i] == 0);
+			}
+
+			s.pos += skip;
+			continue;
+		}
+
+		if (bad) {
+			fprintf(stderr, "damaged: bytes %llu-%llu (%llu)\n",
+					bad_start, off - 1, off - bad_start);
+			damaged++;
+			damaged_bytes += off - bad_start;
+			bad = false;
+		}
+
+		port_seq_t *ps = &ports[hdr.port];
+
+		if (ps->seen && (hdr.seq != ps->next)) {
+			uint32_t lost = hdr.seq - ps->next;
+
+			fprintf(stderr, "port %u: %lu records lost from %lu, "
+					"before byte %llu\n", hdr.port,
+					(unsigned long) lost,
+					(unsigned long) ps->next, off);
+			missing += lost;
+		}
+
+		ps->seen = true;
+		ps->next = hdr.seq + 1;
+
+		if ((!check_only) && ((port < 0) || (hdr.port == port))) {
+			fwrite(p + sizeof(hdr), 1, hdr.len, stdout);
+		}
+
+		records++;
+		payload += hdr.len;
+		s.pos += n;
+	}
+
+	unsigned long long total = s.base + s.fill;
+
+	if (bad && blank) {
+		fprintf(stderr, "unwritten: bytes %llu-%llu (%llu)\n",
+				bad_start, total - 1, total - bad_start);
+	} else if (bad) {
+		fprintf(stderr, "damaged: bytes %llu-%llu (%llu), "
+				"to the end\n", bad_start, total - 1,
+				total - bad_start);
+		damaged++;
+		damaged_bytes += total - bad_start;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	fprintf(stderr, "%llu records, %llu payload bytes; %llu damaged "
+			"ranges (%llu bytes), %llu records lost; %.1f MB/s\n",
+			records, payload, damaged, damaged_bytes, missing,
+			secs > 0 ? total / secs / 1e6 : 0.0);
+
+	fclose(s.f);
+	free(s.buf);
+
+	return damaged ? 2 : 0;
+}
@@ -0,0 +1,358 @@
+// Host test for the receive ring's chunking (Inc/rx_ring.h): the chunks
+// handed out must come out the same whether the write position is kept by
+// the RXNE interrupt, a byte at a time, or read from the DMA's NDTR.
+//
+// Build: cc -O2 -I../Inc -o rx_ring_test rx_ring_test.c
+//
+// Usage: rx_ring_test [SEED [STEPS]]
+//
+// Both models get one random arrival pattern (bursts of 0 to 6K bytes,
+// never more than the ring has room for, so neither mode overruns) and
+// are polled at the same points, some of them past the chunk timeout.
+// Each poll chunks what's there as usart_rx_acquire() does, with the
+// logger's alignment and chunk limits, and releases it straight away.
+// The chunks (ring position, length, the split at the end of the ring and
+// the bytes themselves) are compared, and checked against the stream.
+//
+// Then the DMA alone, overrun: bursts of up to 3/4 of the ring with an
+// interrupt at least every half ring, as usart_rx_dma_ISR() gets them, and
+// a reader that now and then stalls, or holds its lease over a burst.
+// After each overrun the reader must resume on the stream byte that
+// follows the reported drop, and once drained, the bytes handed out plus
+// the bytes reported dropped must be all that was sent.
+//
+// Exits 1 at the first difference.
+
+#include "rx_ring.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_LEN (24 * 4096)
+#define ALIGN 4096
+#define CHUNK_MIN (1 * 4096)
+#define CHUNK_MAX (10 * 4096)
+#define BURST_MAX 6144
+#define LAP_BURST_MAX (RING_LEN * 3 / 4)
+
+typedef struct model_s {
+	bool dma;
+	unsigned int rpos;
+	unsigned int wpos;	// RXNE: kept by the interrupt
+	unsigned int ndtr;	// DMA: counts down, reloads at 0
+	uint8_t ring[RING_LEN];
+} model_t;
+
+typedef struct chunk_s {
+	unsigned int pos;
+	unsigned int len;
+	unsigned int first;
+	unsigned int second;
+	unsigned int segs;
+} chunk_t;
+
+static uint8_t stream_byte(unsigned long long index)
+{
+	return (uint8_t) (index * 131 + (index >> 9));
+}
+
+static unsigned int model_wpos(const model_t *m)
+{
+	return m->dma ? rx_ring_dma_wpos(RING_LEN, m->ndtr) : m->wpos;
+}
+
+// One byte in, as usart_rx_ISR() or the DMA stream would take it
+static void model_receive(model_t *m, uint8_t c)
+{
+	if (m->dma) {
+		m->ring[rx_ring_dma_wpos(RING_LEN, m->ndtr)] = c;
+
+		if (--m->ndtr == 0) {
+			m->ndtr = RING_LEN;
+		}
+	} else {
+		m->ring[m->wpos] = c;
+		m->wpos = rx_ring_advance(m->wpos, 1, RING_LEN);
+	}
+}
+
+// usart_rx_acquire() then usart_rx_release(); false if it would wait on
+static bool model_chunk(model_t *m, bool timed_out, chunk_t *c)
+{
+	unsigned int bytes = rx_ring_used(m->rpos, model_wpos(m), RING_LEN);
+
+	if ((bytes < CHUNK_MIN) && !timed_out) {
+		return false;
+	}
+
+	c->pos = m->rpos;
+	c->len = rx_ring_align_chunk(bytes, m->rpos, ALIGN, CHUNK_MAX);
+	c->segs = rx_ring_split(c->pos, c->len, RING_LEN, &c->first,
+			&c->second);
+
+	m->rpos = rx_ring_advance(m->rpos, c->len, RING_LEN);
+
+	return true;
+}
+
+static bool check_bytes(const model_t *m, const chunk_t *c,
+		unsigned long long index)
+{
+	for (unsigned int i = 0; i < c->len; i++) {
+		if (m->ring[(c->pos + i) % RING_LEN] != stream_byte(index + i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The DMA ring as usart_rx_dma_ISR() and the lease calls keep it
+typedef struct lap_model_s {
+	model_t ring;
+	unsigned int wpos;	// as of the last interrupt
+	unsigned int apos;
+	uint32_t rx_index;	// bytes received, as of wpos
+	bool drop_pending;
+	unsigned int drop_pos;
+	unsigned int spilled;
+	unsigned int spilled_reported;
+	bool held;
+	chunk_t lease;
+	uint32_t lease_end;
+} lap_model_t;
+
+static uint32_t lap_index_at(const lap_model_t *m, unsigned int pos)
+{
+	return m->rx_index - rx_ring_used(pos, m->wpos, RING_LEN);
+}
+
+static void lap_isr(lap_model_t *m)
+{
+	unsigned int next_wpos = model_wpos(&m->ring);
+	unsigned int advanced = rx_ring_used(m->wpos, next_wpos, RING_LEN);
+	unsigned int free = RING_LEN - 1 -
+		rx_ring_used(m->ring.rpos, m->wpos, RING_LEN);
+
+	if (advanced > free) {
+		unsigned int lost = rx_ring_overrun(&m->ring.rpos, &m->apos,
+				advanced, free, RING_LEN);
+
+		if (lost) {
+			m->drop_pos = m->apos;
+			m->drop_pending = true;
+			m->spilled += lost;
+		}
+	}
+
+	m->wpos = next_wpos;
+	m->rx_index += advanced;
+}
+
+static void lap_release(lap_model_t *m)
+{
+	if ((int32_t) (m->lease_end - lap_index_at(m, m->ring.rpos)) > 0) {
+		m->ring.rpos = rx_ring_advance(m->lease.pos, m->lease.len,
+				RING_LEN);
+	}
+
+	m->held = false;
+}
+
+// Take a drop, then acquire what's up to the next one.  Checks the chunk
+// against the stream at *index, which counts drops as well as bytes read.
+// False if there was nothing to hand out.
+static bool lap_read(lap_model_t *m, unsigned long long *index,
+		unsigned long long *dropped, bool *ok)
+{
+	if (m->drop_pending && (m->drop_pos == m->apos)) {
+		*dropped += m->spilled - m->spilled_reported;
+		*index += m->spilled - m->spilled_reported;
+		m->spilled_reported = m->spilled;
+		m->drop_pending = false;
+	}
+
+	unsigned int bytes = rx_ring_used(m->apos, m->wpos, RING_LEN);
+
+	if (m->drop_pending) {
+		unsigned int to_drop = rx_ring_used(m->apos, m->drop_pos,
+				RING_LEN);
+
+		if (to_drop < bytes) {
+			bytes = to_drop;
+		}
+	}
+
+	chunk_t *c = &m->lease;
+
+	c->pos = m->apos;
+	c->len = rx_ring_align_chunk(bytes, m->apos, ALIGN, CHUNK_MAX);
+	c->segs = rx_ring_split(c->pos, c->len, RING_LEN, &c->first,
+			&c->second);
+
+	m->lease_end = lap_index_at(m, m->apos) + c->len;
+	m->apos = rx_ring_advance(m->apos, c->len, RING_LEN);
+	m->held = true;
+
+	*ok = check_bytes(&m->ring, c, *index);
+	*index += c->len;
+
+	return c->len || m->drop_pending;
+}
+
+static int lap_test(unsigned long steps)
+{
+	static lap_model_t m;
+	unsigned long long sent = 0, index = 0, dropped = 0, overruns = 0;
+	unsigned long long chunks = 0;
+	bool ok = true;
+
+	m.ring.dma = true;
+	m.ring.ndtr = RING_LEN;
+
+	for (unsigned long step = 0; step <= steps; step++) {
+		unsigned int burst = (step < steps) ?
+			rand() % (LAP_BURST_MAX + 1) : 0;
+		unsigned int spilled = m.spilled;
+
+		while (burst) {
+			unsigned int event = 1 + rand() % (RING_LEN / 2);
+
+			if (event > burst) {
+				event = burst;
+			}
+
+			for (unsigned int i = 0; i < event; i++) {
+				model_receive(&m.ring, stream_byte(sent++));
+			}
+
+			lap_isr(&m);
+			burst -= event;
+		}
+
+		overruns += (m.spilled != spilled);
+
+		// Drain at the end; till then stall one time in four, and
+		// hold the lease over the next burst one time in four
+		if ((step < steps) && ((rand() % 4) == 0)) {
+			continue;
+		}
+
+		do {
+			if (m.held) {
+				lap_release(&m);
+			}
+
+			if (!lap_read(&m, &index, &dropped, &ok)) {
+				break;
+			}
+
+			if (!ok) {
+				fprintf(stderr, "overrun step %lu: chunk at "
+						"stream byte %llu doesn't "
+						"match the stream\n", step,
+						index - m.lease.len);
+				return 1;
+			}
+
+			chunks++;
+		} while ((step == steps) || (rand() % 4));
+	}
+
+	if (m.held) {
+		lap_release(&m);
+	}
+
+	if ((index != sent) || ((uint32_t) index != m.rx_index)) {
+		fprintf(stderr, "overrun: %llu read and %llu dropped, of %llu "
+				"sent\n", index - dropped, dropped, sent);
+		return 1;
+	}
+
+	printf("%llu chunks, %llu overruns: %llu read and %llu dropped of "
+			"%llu bytes\n", chunks, overruns, index - dropped,
+			dropped, sent);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static model_t rxne, dma;
+	unsigned int seed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+	unsigned long steps = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1000000;
+	unsigned long long sent = 0, read = 0, chunks = 0, wrapped = 0;
+
+	srand(seed);
+
+	dma.dma = true;
+	dma.ndtr = RING_LEN;
+
+	for (unsigned long step = 0; step < steps; step++) {
+		unsigned int used = rx_ring_used(rxne.rpos, rxne.wpos, RING_LEN);
+		unsigned int room = RING_LEN - 1 - used;
+		unsigned int burst = rand() % (BURST_MAX + 1);
+
+		if (burst > room) {
+			burst = room;
+		}
+
+		for (unsigned int i = 0; i < burst; i++) {
+			uint8_t c = stream_byte(sent++);
+
+			model_receive(&rxne, c);
+			model_receive(&dma, c);
+		}
+
+		if (model_wpos(&rxne) != model_wpos(&dma)) {
+			fprintf(stderr, "step %lu: write positions differ: "
+					"RXNE %u, DMA %u\n", step,
+					model_wpos(&rxne), model_wpos(&dma));
+			return 1;
+		}
+
+		bool timed_out = (rand() % 8) == 0;
+		chunk_t a, b;
+		bool got_a = model_chunk(&rxne, timed_out, &a);
+		bool got_b = model_chunk(&dma, timed_out, &b);
+
+		if (got_a != got_b) {
+			fprintf(stderr, "step %lu: RXNE %s a chunk, DMA %s\n",
+					step, got_a ? "got" : "didn't get",
+					got_b ? "did" : "didn't");
+			return 1;
+		}
+
+		if (!got_a) {
+			continue;
+		}
+
+		if ((a.pos != b.pos) || (a.len != b.len) ||
+				(a.segs != b.segs) || (a.first != b.first) ||
+				(a.second != b.second)) {
+			fprintf(stderr, "step %lu: chunks differ: RXNE %u+%u "
+					"(%u/%u), DMA %u+%u (%u/%u)\n", step,
+					a.pos, a.len, a.first, a.second,
+					b.pos, b.len, b.first, b.second);
+			return 1;
+		}
+
+		if ((!check_bytes(&rxne, &a, read)) ||
+				(!check_bytes(&dma, &b, read))) {
+			fprintf(stderr, "step %lu: chunk at stream byte %llu "
+					"doesn't match the stream\n", step,
+					read);
+			return 1;
+		}
+
+		read += a.len;
+		chunks++;
+		wrapped += (a.segs > 1);
+	}
+
+	printf("%llu chunks (%llu wrapped), %llu of %llu bytes: identical\n",
+			chunks, wrapped, read, sent);
+
+	return lap_test(steps / 10);
+}
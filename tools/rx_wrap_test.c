@@ -0,0 +1,174 @@
+// Host test for the receive ring's wrapped chunks (usart_rx_acquire() in
+// Src/uart.c, on the Inc/rx_ring.h helpers): a lap of the ring should be
+// written as whole sectors, a chunk running past the end of the ring
+// coming back as two segments that each start and end on a sector.
+//
+// Build: cc -O2 -I../Inc -o rx_wrap_test rx_wrap_test.c
+//
+// Usage: rx_wrap_test [SEED [STEPS]]
+//
+// Models the acquire path as the logger drives it: 4096 byte alignment,
+// the logger's chunk limits, up to USART_RX_MAX_LEASES leases held and
+// released in random order, random bursts arriving as the ring has room,
+// and now and then a chunk timeout, which hands out whatever is there.
+// Checks each lease:
+//   - its segments are the chunk split at the end of the ring, and add up
+//     to its length;
+//   - unless it was a timeout's short chunk, it ends on a sector, so
+//     every segment of an aligned chunk starts and ends on one;
+//   - hence after a short chunk, the next full chunk is back on a sector,
+//     and from then on every segment is whole sectors again.
+// Exits 1 at the first failure, else prints the segment counts.
+
+#include "rx_ring.h"
+#include "uart.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RING_LEN (24 * 4096)
+#define ALIGN 4096
+#define CHUNK_MIN (1 * 4096)
+#define CHUNK_MAX (10 * 4096)
+#define BURST_MAX 12288
+
+typedef struct lease_s {
+	unsigned int pos;
+	unsigned int len;
+	bool released;
+} lease_t;
+
+static unsigned int rpos, apos, wpos;
+static lease_t leases[USART_RX_MAX_LEASES];
+static unsigned int lease_head, lease_count;
+
+static void release(unsigned int slot)
+{
+	leases[slot].released = true;
+
+	while (lease_count && leases[lease_head].released) {
+		rpos = rx_ring_advance(leases[lease_head].pos,
+				leases[lease_head].len, RING_LEN);
+		lease_head = (lease_head + 1) % USART_RX_MAX_LEASES;
+		lease_count--;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+	unsigned long steps = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1000000;
+	unsigned long long segments = 0, aligned = 0, wrapped = 0, short_ = 0;
+	unsigned long long laps = 0, whole_laps = 0;
+	bool lap_whole = true;
+
+	srand(seed);
+
+	for (unsigned long step = 0; step < steps; step++) {
+		unsigned int room = RING_LEN - 1 -
+			rx_ring_used(rpos, wpos, RING_LEN);
+		unsigned int burst = rand() % (BURST_MAX + 1);
+
+		wpos = rx_ring_advance(wpos, (burst < room) ? burst : room,
+				RING_LEN);
+
+		// Release a random held lease now and then, as the writer
+		// finishes with them out of order
+		if (lease_count && ((lease_count == USART_RX_MAX_LEASES) ||
+					(rand() % 2))) {
+			unsigned int slot;
+
+			do {
+				slot = (lease_head + rand() % lease_count) %
+					USART_RX_MAX_LEASES;
+			} while (leases[slot].released);
+
+			release(slot);
+		}
+
+		if (lease_count == USART_RX_MAX_LEASES) {
+			continue;
+		}
+
+		unsigned int bytes = rx_ring_used(apos, wpos, RING_LEN);
+		bool timed_out = (rand() % 16) == 0;
+
+		if ((bytes < CHUNK_MIN) && !timed_out) {
+			continue;
+		}
+
+		unsigned int unalign = apos % ALIGN;
+		unsigned int len = rx_ring_align_chunk(bytes, apos, ALIGN,
+				CHUNK_MAX);
+		unsigned int first, second;
+		unsigned int segs = rx_ring_split(apos, len, RING_LEN, &first,
+				&second);
+		bool full = (((bytes < CHUNK_MAX) ? bytes : CHUNK_MAX) +
+				unalign) >= ALIGN;
+
+		if ((first + ((segs > 1) ? second : 0) != len) ||
+				((segs > 1) && (apos + first != RING_LEN))) {
+			fprintf(stderr, "step %lu: bad split of %u+%u: %u/%u\n",
+					step, apos, len, first, second);
+			return 1;
+		}
+
+		if (full && ((apos + len) % ALIGN)) {
+			fprintf(stderr, "step %lu: full chunk %u+%u doesn't "
+					"end on a sector\n", step, apos, len);
+			return 1;
+		}
+
+		if (!len) {
+			continue;
+		}
+
+		unsigned int slot = (lease_head + lease_count) %
+			USART_RX_MAX_LEASES;
+
+		leases[slot] = (lease_t) { apos, len, false };
+		lease_count++;
+
+		for (unsigned int s = 0; s < segs; s++) {
+			unsigned int start = s ? 0 : apos;
+			unsigned int end = s ? second : apos + first;
+
+			segments++;
+
+			if ((start % ALIGN == 0) && (end % ALIGN == 0)) {
+				aligned++;
+				continue;
+			}
+
+			lap_whole = false;
+
+			// Only a short chunk, or the one realigning after
+			// it, may have a part sector
+			if (full && !unalign) {
+				fprintf(stderr, "step %lu: segment %u-%u of an "
+						"aligned chunk isn't whole "
+						"sectors\n", step, start, end);
+				return 1;
+			}
+		}
+
+		wrapped += (segs > 1);
+		short_ += !full;
+
+		apos = rx_ring_advance(apos, len, RING_LEN);
+
+		if (segs > 1) {
+			laps++;
+			whole_laps += lap_whole;
+			lap_whole = true;
+		}
+	}
+
+	printf("%llu segments: %llu whole sectors, %llu from %llu timeout "
+			"chunks and what followed them\n", segments, aligned,
+			segments - aligned, short_);
+	printf("%llu wrapped chunks; %llu of %llu laps all whole sectors\n",
+			wrapped, whole_laps, laps);
+
+	return 0;
+}
@@ -0,0 +1,439 @@
+// Soak test generator and verifier for the logger's ingest-to-file path.
+//
+// Build: cc -O2 -o soak soak.c
+//
+// Usage:
+//   soak gen [options] DEVICE|-      send records to a tty (or stdout)
+//     -b BAUD     set the tty's baud rate (default: leave it alone)
+//     -r RATE     average rate in bytes/s (default: as fast as possible)
+//     -B N        records per burst (default 1)
+//     -g MS       idle gap between bursts, on top of the rate (default 0)
+//     -n N        records to send (default: until killed)
+//     -s SEQ      first sequence number (default 0)
+//     -l LEN      largest payload, 0..255 (default 64)
+//
+//   soak verify FILE [FIRST [LAST]]   check a log written from gen
+//
+// Each record is self checking and deterministic from its sequence number:
+//
+//   0xA5 0x5A  seq (u32 LE)  len (u8)  payload[len]  crc16 (LE)
+//
+// The payload is an xorshift stream seeded from seq, len is derived from
+// seq too, and the CRC-16/CCITT-FALSE covers seq, len and payload.  So the
+// verifier needs nothing but the log: it reports every missing sequence
+// range, every duplicate, and every byte range it couldn't parse as a
+// record.  In-band markers ("\n@@...\n") are reported, not counted as
+// corruption.  Give FIRST/LAST (the range gen reports it sent) to also
+// catch loss at the very start or end.  Exit status is 0 only for a clean
+// log.
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REC_MAGIC0 0xA5
+#define REC_MAGIC1 0x5A
+#define REC_HDR 7	// magic, seq, len
+#define REC_MAX (REC_HDR + 255 + 2)
+
+static uint16_t crc16(const uint8_t *p, unsigned int len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (len--) {
+		crc ^= *p++ << 8;
+
+		for (int i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+static uint32_t xorshift(uint32_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+
+	return *x;
+}
+
+// Builds record 'seq' into buf; returns its length.
+static unsigned int make_record(uint8_t *buf, uint32_t seq,
+		unsigned int max_len)
+{
+	uint32_t x = seq * 2654435761u + 1;
+	unsigned int len = xorshift(&x) % (max_len + 1);
+
+	buf[0] = REC_MAGIC0;
+	buf[1] = REC_MAGIC1;
+	buf[2] = seq;
+	buf[3] = seq >> 8;
+	buf[4] = seq >> 16;
+	buf[5] = seq >> 24;
+	buf[6] = len;
+
+	for (unsigned int i = 0; i < len; i++) {
+		buf[REC_HDR + i] = xorshift(&x);
+	}
+
+	uint16_t crc = crc16(buf + 2, REC_HDR - 2 + len);
+
+	buf[REC_HDR + len] = crc;
+	buf[REC_HDR + len + 1] = crc >> 8;
+
+	return REC_HDR + len + 2;
+}
+
+/* Generator --------------------------------------------------------------- */
+
+static speed_t baud_const(unsigned long baud)
+{
+	static const struct {
+		unsigned long baud;
+		speed_t speed;
+	} bauds[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+		{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+		{ 460800, B460800 }, { 921600, B921600 },
+		{ 1000000, B1000000 }, { 1500000, B1500000 },
+		{ 2000000, B2000000 }, { 3000000, B3000000 },
+		{ 4000000, B4000000 },
+	};
+
+	for (unsigned int i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+		if (bauds[i].baud == baud) {
+			return bauds[i].speed;
+		}
+	}
+
+	fprintf(stderr, "unsupported baud %lu\n", baud);
+	exit(2);
+}
+
+static int open_output(const char *name, unsigned long baud)
+{
+	if (!strcmp(name, "-")) {
+		return STDOUT_FILENO;
+	}
+
+	int fd = open(name, O_WRONLY | O_NOCTTY);
+
+	if (fd < 0) {
+		perror(name);
+		exit(2);
+	}
+
+	struct termios tio;
+
+	if (baud && !tcgetattr(fd, &tio)) {
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, baud_const(baud));
+		tio.c_cflag &= ~CRTSCTS;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	double d = t - now_s();
+
+	if (d > 0) {
+		struct timespec ts = { (time_t) d, (long) ((d - (time_t) d) * 1e9) };
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int gen(int argc, char **argv)
+{
+	unsigned long baud = 0, rate = 0, burst = 1, gap_ms = 0, max_len = 64;
+	unsigned long long count = 0;
+	uint32_t seq = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:r:B:g:n:s:l:")) != -1) {
+		switch (opt) {
+		case 'b': baud = strtoul(optarg, NULL, 0); break;
+		case 'r': rate = strtoul(optarg, NULL, 0); break;
+		case 'B': burst = strtoul(optarg, NULL, 0); break;
+		case 'g': gap_ms = strtoul(optarg, NULL, 0); break;
+		case 'n': count = strtoull(optarg, NULL, 0); break;
+		case 's': seq = strtoul(optarg, NULL, 0); break;
+		case 'l': max_len = strtoul(optarg, NULL, 0); break;
+		default: return 2;
+		}
+	}
+
+	if ((optind >= argc) || (max_len > 255) || !burst) {
+		fprintf(stderr, "usage: soak gen [-b baud] [-r rate] [-B burst] "
+				"[-g gap_ms] [-n count] [-s seq] [-l len] "
+				"device|-\n");
+		return 2;
+	}
+
+	int fd = open_output(argv[optind], baud);
+	uint8_t buf[REC_MAX * 64];
+	unsigned long long sent = 0, bytes = 0;
+	double start = now_s(), due = start;
+
+	while (!count || (sent < count)) {
+		unsigned int len = 0;
+
+		for (unsigned long i = 0; (i < burst) &&
+				(!count || (sent < count)); i++) {
+			if (len + REC_MAX > sizeof(buf)) {
+				if (write(fd, buf, len) != (ssize_t) len) {
+					perror("write");
+					return 2;
+				}
+
+				bytes += len;
+				len = 0;
+			}
+
+			len += make_record(buf + len, seq++, max_len);
+			sent++;
+		}
+
+		if (write(fd, buf, len) != (ssize_t) len) {
+			perror("write");
+			return 2;
+		}
+
+		bytes += len;
+
+		if (rate) {
+			due += (double) len / rate;
+		}
+
+		due += gap_ms / 1000.0;
+
+		sleep_until(due);
+	}
+
+	if (fd != STDOUT_FILENO) {
+		tcdrain(fd);
+	}
+
+	double secs = now_s() - start;
+
+	fprintf(stderr, "sent seq %lu..%lu, %llu bytes in %.2fs (%.0f B/s)\n",
+			(unsigned long) (seq - sent), (unsigned long) (seq - 1),
+			bytes, secs, bytes / secs);
+
+	return 0;
+}
+
+/* Verifier ---------------------------------------------------------------- */
+
+static int parse_record(const uint8_t *p, size_t avail, uint32_t *seq)
+{
+	if ((avail < REC_HDR + 2) || (p[0] != REC_MAGIC0) ||
+			(p[1] != REC_MAGIC1)) {
+		return 0;
+	}
+
+	unsigned int len = REC_HDR + p[6] + 2;
+
+	if (avail < len) {
+		return 0;
+	}
+
+	uint16_t crc = p[len - 2] | (p[len - 1] << 8);
+
+	if (crc16(p + 2, len - 4) != crc) {
+		return 0;
+	}
+
+	*seq = p[2] | (p[3] << 8) | (p[4] << 16) | ((uint32_t) p[5] << 24);
+
+	return len;
+}
+
+// "\n@@...\n", as written by the logger
+static size_t marker_len(const uint8_t *p, size_t avail)
+{
+	if ((avail < 4) || (p[0] != '\n') || (p[1] != '@') || (p[2] != '@')) {
+		return 0;
+	}
+
+	const uint8_t *end = memchr(p + 3, '\n', avail - 3);
+
+	return end ? (size_t) (end - p + 1) : 0;
+}
+
+static void print_dups(size_t at, uint32_t first, uint32_t last,
+		uint32_t expect)
+{
+	printf("dup @%zu: seq %lu..%lu again (%lu, expected %lu)\n", at,
+			(unsigned long) first, (unsigned long) last,
+			(unsigned long) (last - first + 1),
+			(unsigned long) expect);
+}
+
+static int verify(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: soak verify file [first [last]]\n");
+		return 2;
+	}
+
+	FILE *f = fopen(argv[2], "rb");
+
+	if (!f) {
+		perror(argv[2]);
+		return 2;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *data = malloc(size + 1);
+
+	if ((!data) || (fread(data, 1, size, f) != size)) {
+		fprintf(stderr, "%s: read failed\n", argv[2]);
+		return 2;
+	}
+
+	fclose(f);
+
+	int have_first = argc > 3, have_last = argc > 4;
+	uint32_t expect = have_first ? strtoul(argv[3], NULL, 0) : 0;
+	uint32_t last = have_last ? strtoul(argv[4], NULL, 0) : 0;
+	int started = have_first;
+	unsigned long long good = 0, gaps = 0, missing = 0, dups = 0;
+	unsigned long long corrupt = 0, markers = 0;
+	size_t bad_start = 0, dup_at = 0, i = 0;
+	int in_bad = 0, in_dup = 0;
+	uint32_t dup_first = 0, dup_last = 0;
+
+	while (i < size) {
+		uint32_t seq;
+		size_t n = parse_record(data + i, size - i, &seq);
+
+		if (!n) {
+			size_t m = marker_len(data + i, size - i);
+
+			if (m) {
+				printf("marker @%zu: %.*s\n", i, (int) (m - 2),
+						data + i + 1);
+				markers++;
+				i += m;
+				continue;
+			}
+
+			if (!in_bad) {
+				bad_start = i;
+				in_bad = 1;
+			}
+
+			i++;
+			continue;
+		}
+
+		if (in_bad) {
+			printf("corrupt @%zu..%zu (%zu bytes)\n", bad_start,
+					i - 1, i - bad_start);
+			corrupt += i - bad_start;
+			in_bad = 0;
+		}
+
+		if (!started) {
+			expect = seq;
+			started = 1;
+		}
+
+		// Report runs of duplicates as one range
+		if (in_dup && ((seq != dup_last + 1) ||
+					((int32_t) (seq - expect) >= 0))) {
+			print_dups(dup_at, dup_first, dup_last, expect);
+			in_dup = 0;
+		}
+
+		if (seq == expect) {
+			expect++;
+		} else if ((int32_t) (seq - expect) > 0) {
+			printf("gap @%zu: seq %lu..%lu missing (%lu)\n", i,
+					(unsigned long) expect,
+					(unsigned long) (seq - 1),
+					(unsigned long) (seq - expect));
+			gaps++;
+			missing += seq - expect;
+			expect = seq + 1;
+		} else {
+			if (!in_dup) {
+				dup_at = i;
+				dup_first = seq;
+				in_dup = 1;
+			}
+
+			dup_last = seq;
+			dups++;
+		}
+
+		good++;
+		i += n;
+	}
+
+	if (in_dup) {
+		print_dups(dup_at, dup_first, dup_last, expect);
+	}
+
+	if (in_bad) {
+		printf("corrupt @%zu..%zu (%zu bytes, at end)\n", bad_start,
+				size - 1, size - bad_start);
+		corrupt += size - bad_start;
+	}
+
+	if (have_last && ((int32_t) (last + 1 - expect) > 0)) {
+		printf("gap at end: seq %lu..%lu missing (%lu)\n",
+				(unsigned long) expect, (unsigned long) last,
+				(unsigned long) (last + 1 - expect));
+		gaps++;
+		missing += last + 1 - expect;
+	}
+
+	printf("%zu bytes: %llu records ok, %llu gaps (%llu records), "
+			"%llu dups, %llu corrupt bytes, %llu markers\n",
+			size, good, gaps, missing, dups, corrupt, markers);
+
+	free(data);
+
+	return (gaps || dups || corrupt) ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc > 1) && !strcmp(argv[1], "gen")) {
+		return gen(argc - 1, argv + 1);
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "verify")) {
+		return verify(argc, argv);
+	}
+
+	fprintf(stderr, "usage: soak gen|verify ...\n");
+	return 2;
+}
@@ -0,0 +1,233 @@
+// Host decoder and benchmark for the logger's compressed logs
+// ("compress" : "lz4", see Src/lz_block.c).
+//
+// Build: cc -O2 -I../Inc -o unlz unlz.c ../Src/lz_block.c
+//
+// Usage:
+//   unlz LOG [PORT] > raw        decompress a log
+//   unlz -b FILE [BLOCK]         compress FILE as the logger would
+//
+// A compressed log is a run of blocks, each an lz_block_hdr_t and its
+// payload.  Every block stands alone, so a log cut short by a power cut
+// decodes up to its last whole block.  When ports were interleaved, each
+// container record holds one block; give the port (USART number, 0 for
+// the SPI slave) to pick its stream out, or leave it off for all of them
+// concatenated in file order.
+//
+// -b compresses FILE (e.g. a log written without compression) in BLOCK
+// byte blocks (default 4096, the logger's default) and prints the ratio
+// and throughput.  The logger's own figures for the real thing, in CPU
+// cycles a byte on the F411, are in its @@COMP markers; at 96 MHz and 10
+// bits a byte, a baud rate of B leaves 9.6e8 / B cycles a byte.
+
+#include "lz_block.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CONTAINER_MAGIC 'U'
+
+static uint8_t *read_file(const char *name, size_t *len)
+{
+	FILE *f = fopen(name, "rb");
+
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *buf = malloc(*len ? *len : 1);
+
+	if (fread(buf, 1, *len, f) != *len) {
+		perror(name);
+		exit(1);
+	}
+
+	fclose(f);
+
+	return buf;
+}
+
+// Decode the block at buf; returns its length on the wire, 0 if there
+// isn't a whole block there.
+static size_t decode_block(const uint8_t *buf, size_t avail, FILE *out)
+{
+	static uint8_t raw[LZ_BLOCK_MAX];
+	lz_block_hdr_t hdr;
+
+	if (avail < sizeof(hdr)) {
+		return 0;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if ((hdr.magic[0] != LZ_MAGIC0) || (hdr.magic[1] != LZ_MAGIC1) ||
+			(hdr.raw_len > LZ_BLOCK_MAX) ||
+			(avail - sizeof(hdr) < hdr.comp_len)) {
+		return 0;
+	}
+
+	const uint8_t *payload = buf + sizeof(hdr);
+
+	if (hdr.method == LZ_METHOD_STORED) {
+		if (hdr.comp_len != hdr.raw_len) {
+			return 0;
+		}
+
+		fwrite(payload, 1, hdr.raw_len, out);
+	} else if (hdr.method == LZ_METHOD_LZ4) {
+		int n = lz_decompress(payload, hdr.comp_len, raw, sizeof(raw));
+
+		if (n != hdr.raw_len) {
+			return 0;
+		}
+
+		fwrite(raw, 1, n, out);
+	} else {
+		return 0;
+	}
+
+	return sizeof(hdr) + hdr.comp_len;
+}
+
+static int decode(const char *name, int port)
+{
+	size_t len;
+	uint8_t *buf = read_file(name, &len);
+	size_t pos = 0;
+	unsigned long blocks = 0;
+	int interleaved = (len > 0) && (buf[0] == CONTAINER_MAGIC);
+
+	while (pos < len) {
+		size_t n;
+
+		if (interleaved) {
+			if ((len - pos < 4) || (buf[pos] != CONTAINER_MAGIC)) {
+				break;
+			}
+
+			size_t rec_len = buf[pos + 2] | (buf[pos + 3] << 8);
+			int rec_port = buf[pos + 1];
+
+			pos += 4;
+
+			if (len - pos < rec_len) {
+				break;
+			}
+
+			if ((port < 0) || (rec_port == port)) {
+				if (decode_block(buf + pos, rec_len, stdout) !=
+						rec_len) {
+					break;
+				}
+				blocks++;
+			}
+
+			n = rec_len;
+		} else {
+			n = decode_block(buf + pos, len - pos, stdout);
+
+			if (!n) {
+				break;
+			}
+			blocks++;
+		}
+
+		pos += n;
+	}
+
+	fprintf(stderr, "%lu blocks", blocks);
+
+	if (pos < len) {
+		fprintf(stderr, ", stopped at offset %zu of %zu "
+				"(cut short, or not a compressed log)", pos, len);
+	}
+
+	fprintf(stderr, "\n");
+
+	free(buf);
+
+	return 0;
+}
+
+static int bench(const char *name, unsigned int block)
+{
+	static lz_state_t st;
+	size_t len;
+	uint8_t *buf = read_file(name, &len);
+	uint8_t *out = malloc(LZ_BOUND(block));
+	uint8_t *check = malloc(block);
+	unsigned long long comp_total = 0;
+	int repeat = 20;
+
+	if ((block < 256) || (block > LZ_BLOCK_MAX)) {
+		fprintf(stderr, "block must be 256..%u\n", LZ_BLOCK_MAX);
+		return 1;
+	}
+
+	// One pass checking every block round trips, then timed passes
+	for (size_t pos = 0; pos < len; pos += block) {
+		unsigned int n = (len - pos < block) ? len - pos : block;
+		unsigned int c = lz_compress(&st, buf + pos, n, out,
+				LZ_BOUND(block));
+
+		if ((!c) || (c >= n)) {
+			c = n;	// stored
+		} else if ((lz_decompress(out, c, check, block) != (int) n) ||
+				memcmp(check, buf + pos, n)) {
+			fprintf(stderr, "round trip failed at %zu\n", pos);
+			return 1;
+		}
+
+		comp_total += sizeof(lz_block_hdr_t) + c;
+	}
+
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (int r = 0; r < repeat; r++) {
+		for (size_t pos = 0; pos < len; pos += block) {
+			unsigned int n = (len - pos < block) ? len - pos : block;
+
+			lz_compress(&st, buf + pos, n, out, LZ_BOUND(block));
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double bytes = (double) len * repeat;
+
+	printf("%zu -> %llu bytes, ratio %.2f (%.1f%%), %.1f MB/s, "
+			"%.2f ns/byte\n", len, comp_total,
+			comp_total ? (double) len / comp_total : 0.0,
+			len ? 100.0 * comp_total / len : 0.0,
+			bytes / secs / 1e6, secs * 1e9 / bytes);
+
+	free(out);
+	free(check);
+	free(buf);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc >= 3) && !strcmp(argv[1], "-b")) {
+		return bench(argv[2], (argc > 3) ? atoi(argv[3]) : 4096);
+	}
+
+	if ((argc < 2) || (argv[1][0] == '-')) {
+		fprintf(stderr, "usage: %s log [port] > raw\n"
+				"       %s -b file [block]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	return decode(argv[1], (argc > 2) ? atoi(argv[2]) : -1);
+}